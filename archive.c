@@ -0,0 +1,788 @@
+/*
+ * file: archive.c
+ *
+ * buffered output and input for the archive file
+ *
+ * everything written to the archive goes through here so that it
+ * leaves in a few large writes instead of one write per 512 byte block,
+ * compressed on the way out if asked to
+ *
+ * everything read from an archive comes through here too, so compressed
+ * archives can be listed and extracted without a pipe
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "util.h"
+#include "archive.h"
+#include "compress.h"
+
+/* most bytes moved by one copy_file_range/sendfile call */
+#define COPY_CHUNK (1 << 30)
+/* buffer in_copy goes through when the kernel can't copy for it */
+#define IN_COPY_BUF (256 * 1024)
+/* the smallest run of zeros in_copy_holes leaves as a hole */
+#define HOLE_BLOCK ALIGN_SIZE
+/* the least and the most in_copy_holes allocates ahead of its writes */
+#define ALLOC_AHEAD_MIN (1024 * 1024)
+#define ALLOC_AHEAD_MAX (256 * 1024 * 1024)
+/* kernel_copy couldn't, the caller has to move the bytes itself */
+#define KERNEL_NO_COPY -2
+
+/*
+ * kernel copies that turned out not to work here, so they aren't tried
+ * again. Extract workers share them, so only touch them atomically
+ */
+static int no_copy_range, no_sendfile, no_clone;
+
+/*
+ * writev every byte in iov, picking up after short writes
+ */
+void write_iov(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("mytar");
+        }
+        /* step over whatever made it out */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ * send out the bytes in iov, through the compressor if there is one
+ */
+void out_emit(struct archive_out *out, struct iovec *iov, int iovcnt) {
+    int i;
+
+    if (out->comp == NULL) {
+        write_iov(out->fd, iov, iovcnt);
+        return;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        comp_write(out->comp, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+/*
+ * set up buffered output on fd with records of blocking blocks
+ * pad_last pads the archive out to a whole record when it is closed
+ * method compresses the output on threads threads
+ */
+struct archive_out *out_open(int fd, int blocking, int pad_last,
+                                int method, int threads) {
+    struct archive_out *out;
+    struct compressor *comp = NULL;
+    struct stat st;
+
+    /* first, since it can fail for want of a method we weren't built
+     * with and there's nothing to clean up yet */
+    if (method != COMP_NONE) {
+        comp = comp_open(fd, method, threads);
+    }
+
+    if ((out = calloc(1, sizeof(struct archive_out))) == NULL) {
+        fail("mytar");
+    }
+    out->fd = fd;
+    out->record = (size_t)blocking * BLOCK;
+    out->pad_last = pad_last;
+    out->comp = comp;
+
+    /* records are aligned for devices that care about it */
+    if (posix_memalign((void **)&out->buf, BLOCK, out->record)) {
+        fail("mytar");
+    }
+
+    /* only regular files can take data straight from the kernel,
+     * and only if it doesn't need compressing first */
+    if (method == COMP_NONE) {
+        out->direct = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    }
+
+    return out;
+}
+
+/*
+ * add n bytes to the archive
+ * whole records are written as soon as they fill; big writes skip
+ * the buffer and go out with writev alongside what was waiting in it
+ */
+void out_write(struct archive_out *out, const void *data, size_t n) {
+    struct iovec iov[2];
+    size_t room, take;
+
+    out->pos += n;
+
+    /* fits in the current record */
+    room = out->record - out->len;
+    if (n < room) {
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        return;
+    }
+
+    /* write the buffered bytes and as many whole records of data
+     * as we have, without copying the data first */
+    take = room + (n - room) / out->record * out->record;
+    iov[0].iov_base = out->buf;
+    iov[0].iov_len = out->len;
+    iov[1].iov_base = (char *)data;
+    iov[1].iov_len = take;
+    out_emit(out, iov, 2);
+
+    /* keep the tail for the next record */
+    out->len = n - take;
+    memcpy(out->buf, (char *)data + take, out->len);
+}
+
+/*
+ * add n zero bytes to the archive
+ */
+void out_zeros(struct archive_out *out, size_t n) {
+    size_t take;
+
+    out->pos += n;
+    while (n > 0) {
+        take = out->record - out->len;
+        if (take > n) {
+            take = n;
+        }
+        memset(out->buf + out->len, 0, take);
+        out->len += take;
+        n -= take;
+        if (out->len == out->record) {
+            out_flush(out);
+        }
+    }
+}
+
+/*
+ * copy up to chunk bytes from infd to outfd in the kernel, with
+ * copy_file_range or failing that sendfile. infd is read at *inoff if
+ * inoff isn't NULL (and its own offset is left alone), outfd is written
+ * at its offset
+ * returns the bytes copied, 0 at the end of infd, -1 on an error or
+ * KERNEL_NO_COPY if neither works here
+ */
+ssize_t kernel_copy(int infd, off_t *inoff, int outfd, size_t chunk) {
+    ssize_t n;
+
+    if (!__atomic_load_n(&no_copy_range, __ATOMIC_RELAXED)) {
+        n = copy_file_range(infd, inoff, outfd, NULL, chunk, 0);
+        if (n != -1 || (errno != EINVAL && errno != EXDEV &&
+                errno != ENOSYS && errno != EOPNOTSUPP)) {
+            return n;
+        }
+        __atomic_store_n(&no_copy_range, 1, __ATOMIC_RELAXED);
+    }
+    if (!__atomic_load_n(&no_sendfile, __ATOMIC_RELAXED)) {
+        n = sendfile(outfd, infd, inoff, chunk);
+        if (n != -1 || (errno != EINVAL && errno != ENOSYS)) {
+            return n;
+        }
+        __atomic_store_n(&no_sendfile, 1, __ATOMIC_RELAXED);
+    }
+    return KERNEL_NO_COPY;
+}
+
+/*
+ * copy len bytes from infile into the archive
+ * regular archive files get the data straight from the kernel
+ * (copy_file_range, then sendfile), everything else reads into the record
+ * returns the bytes copied, fewer than len if infile ended early
+ */
+off_t out_copy(struct archive_out *out, int infile, off_t len) {
+    off_t done = 0;
+    ssize_t n;
+    size_t chunk;
+
+    /* the kernel writes at the file offset, so get in line first */
+    if (out->direct) {
+        out_flush(out);
+    }
+
+    while (done < len) {
+        chunk = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
+
+        n = KERNEL_NO_COPY;
+        if (out->direct) {
+            n = kernel_copy(infile, NULL, out->fd, chunk);
+        }
+        if (n == KERNEL_NO_COPY) {
+            /* read right into the record, no bounce buffer */
+            if (chunk > out->record - out->len) {
+                chunk = out->record - out->len;
+            }
+            n = read(infile, out->buf + out->len, chunk);
+            if (n > 0) {
+                out->len += n;
+                if (out->len == out->record) {
+                    out_flush(out);
+                }
+            }
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("mytar");
+        }
+        /* the file got shorter since we looked at it */
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    out->pos += done;
+
+    return done;
+}
+
+/*
+ * write out whatever is waiting in the record buffer
+ */
+void out_flush(struct archive_out *out) {
+    struct iovec iov;
+
+    if (out->len > 0) {
+        iov.iov_base = out->buf;
+        iov.iov_len = out->len;
+        out_emit(out, &iov, 1);
+        out->len = 0;
+    }
+}
+
+/*
+ * free the output, dropping anything not written out yet
+ * (the fd stays open)
+ */
+void out_free(struct archive_out *out) {
+    if (out->comp != NULL) {
+        comp_free(out->comp);
+    }
+    free(out->buf);
+    free(out);
+}
+
+/*
+ * finish the last record and free the output (the fd stays open)
+ */
+void out_close(struct archive_out *out) {
+    if (out->pad_last && out->pos % out->record) {
+        out_zeros(out, out->record - out->pos % out->record);
+    }
+    out_flush(out);
+    if (out->comp != NULL) {
+        comp_close(out->comp);
+        out->comp = NULL;
+    }
+    out_free(out);
+}
+
+/*
+ * start reading an archive from fd
+ * the first block tells us whether it is compressed
+ */
+struct archive_in *in_open(int fd) {
+    struct archive_in *in;
+    ssize_t n;
+
+    if ((in = calloc(1, sizeof(struct archive_in))) == NULL) {
+        fail("mytar");
+    }
+    in->fd = fd;
+
+    while (in->npeek < BLOCK) {
+        n = read(fd, in->peek + in->npeek, BLOCK - in->npeek);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            free(in);
+            fail("mytar");
+        }
+        if (n == 0) {
+            break;
+        }
+        in->npeek += n;
+    }
+
+    /* nothing to clean up if it's compressed with something we weren't
+     * built for */
+    in->method = comp_detect((unsigned char *)in->peek, in->npeek);
+#ifndef HAVE_ZSTD
+    if (in->method == COMP_ZSTD) {
+        free(in);
+        fail_msg("mytar: built without zstd support");
+    }
+#endif
+    if (in->method != COMP_NONE) {
+        in->dec = decomp_open(fd, in->method, in->peek, in->npeek);
+        in->npeek = 0;
+    } else if (lseek(fd, 0, SEEK_SET) == 0) {
+        /* plain archive we can rewind, go back to reading it directly */
+        in->npeek = 0;
+    }
+    return in;
+}
+
+/*
+ * map a plain archive file in whole, so reading headers is a copy out of
+ * the page cache and skipping a member's data touches none of its pages
+ * stays as it was if the archive is compressed, a pipe or can't be mapped
+ */
+void in_map(struct archive_in *in) {
+    struct stat st;
+    void *map;
+
+    if (in->dec != NULL || in->peekpos < in->npeek ||
+            fstat(in->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            st.st_size == 0) {
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    /* headers are far apart, don't read ahead through the data between */
+    madvise(map, st.st_size, MADV_RANDOM);
+    in->map = map;
+    in->maplen = st.st_size;
+    in->mappos = lseek(in->fd, 0, SEEK_CUR);
+    if (in->mappos == -1 || in->mappos > in->maplen) {
+        in->mappos = in->maplen;
+    }
+}
+
+/*
+ * read n bytes of archive, fewer only at the end of it
+ * returns the number of bytes read
+ */
+ssize_t in_read(struct archive_in *in, void *buf, size_t n) {
+    size_t got = 0, take;
+    ssize_t r;
+
+    if (in->dec != NULL) {
+        return decomp_read(in->dec, buf, n);
+    }
+    if (in->map != NULL) {
+        if ((off_t)n > in->maplen - in->mappos) {
+            n = in->maplen - in->mappos;
+        }
+        memcpy(buf, in->map + in->mappos, n);
+        in->mappos += n;
+        return n;
+    }
+
+    /* what we looked at to find the method comes first */
+    if (in->peekpos < in->npeek) {
+        take = in->npeek - in->peekpos;
+        if (take > n) {
+            take = n;
+        }
+        memcpy(buf, in->peek + in->peekpos, take);
+        in->peekpos += take;
+        got = take;
+    }
+
+    while (got < n) {
+        r = read(in->fd, (char *)buf + got, n - got);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1) {
+            fail("mytar");
+        }
+        if (r == 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+/*
+ * skip over n bytes of archive
+ * seeks when it can, otherwise reads and throws them away
+ */
+void in_skip(struct archive_in *in, off_t n) {
+    char buf[BLOCK * 16];
+    size_t take;
+    off_t page;
+
+    if (n <= 0) {
+        return;
+    }
+    if (in->map != NULL) {
+        /* past the end is like seeking there, the next read gets nothing */
+        in->mappos = n < in->maplen - in->mappos ? in->mappos + n : in->maplen;
+        /* ask for the page the next header is on while this one is done */
+        if (n > ALIGN_SIZE && in->mappos < in->maplen) {
+            page = in->mappos / ALIGN_SIZE * ALIGN_SIZE;
+            madvise(in->map + page, ALIGN_SIZE, MADV_WILLNEED);
+        }
+        return;
+    }
+    if (in->dec == NULL && in->peekpos == in->npeek &&
+            lseek(in->fd, n, SEEK_CUR) != -1) {
+        return;
+    }
+    while (n > 0) {
+        take = n < (off_t)sizeof(buf) ? n : sizeof(buf);
+        if (in_read(in, buf, take) != (ssize_t)take) {
+            fail_msg("error: currupted archive");
+        }
+        n -= take;
+    }
+}
+
+/*
+ * copy the next len bytes of archive into outfile, at its offset
+ * memory use is the same whatever len is: uncompressed archives are
+ * copied by the kernel (copy_file_range, then sendfile), the rest go
+ * through one small buffer
+ */
+void in_copy(struct archive_in *in, int outfile, off_t len) {
+    size_t chunk;
+    ssize_t n;
+
+    /* what we looked at to find the method comes first */
+    if (in->peekpos < in->npeek && len > 0) {
+        chunk = in->npeek - in->peekpos;
+        if (chunk > len) {
+            chunk = len;
+        }
+        write_all(outfile, in->peek + in->peekpos, chunk);
+        in->peekpos += chunk;
+        len -= chunk;
+    }
+
+    if (in->map != NULL) {
+        if (len > in->maplen - in->mappos) {
+            fail_msg("error: currupted archive");
+        }
+        write_all(outfile, in->map + in->mappos, len);
+        in->mappos += len;
+        return;
+    }
+
+    while (len > 0) {
+        chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+
+        n = KERNEL_NO_COPY;
+        if (in->dec == NULL) {
+            n = kernel_copy(in->fd, NULL, outfile, chunk);
+        }
+        if (n == KERNEL_NO_COPY) {
+            if (in->buf == NULL && (in->buf = malloc(IN_COPY_BUF)) == NULL) {
+                fail("mytar");
+            }
+            if (chunk > IN_COPY_BUF) {
+                chunk = IN_COPY_BUF;
+            }
+            if ((n = in_read(in, in->buf, chunk)) > 0) {
+                write_all(outfile, in->buf, n);
+            }
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("mytar");
+        }
+        /* the archive ended in the middle of the member */
+        if (n == 0) {
+            fail_msg("error: currupted archive");
+        }
+        len -= n;
+    }
+}
+
+/*
+ * where the next byte of archive is in the file
+ * returns -1 unless the archive can be read at an offset (in_copy_at),
+ * which it can't if it is compressed or a pipe
+ */
+off_t in_offset(struct archive_in *in) {
+    if (in->dec != NULL || in->peekpos < in->npeek) {
+        return -1;
+    }
+    if (in->map != NULL) {
+        return in->mappos;
+    }
+    return lseek(in->fd, 0, SEEK_CUR);
+}
+
+/*
+ * move to offset in an uncompressed archive, for a member found in its
+ * index, returns -1 if the archive is compressed
+ */
+int in_seek(struct archive_in *in, off_t offset) {
+    if (in->dec != NULL) {
+        return -1;
+    }
+    in->npeek = in->peekpos = 0;
+    if (in->map != NULL) {
+        in->mappos = offset < in->maplen ? offset : in->maplen;
+        return 0;
+    }
+    if (lseek(in->fd, offset, SEEK_SET) == -1) {
+        fail("mytar");
+    }
+    return 0;
+}
+
+/*
+ * does the HOLE_BLOCK at buf (with left bytes from there) hold only zeros?
+ * compares it with itself a byte on, which glibc's memcmp does a vector
+ * register at a time
+ */
+int zero_block(const char *buf, size_t left) {
+    return left >= HOLE_BLOCK && buf[0] == 0 &&
+                memcmp(buf, buf + 1, HOLE_BLOCK - 1) == 0;
+}
+
+/*
+ * write n bytes of buf to outfile at pos, except for whole HOLE_BLOCKs
+ * of zeros, which are left as holes
+ * the file was allocated up to allocated beforehand, so zeros below that
+ * have their space given back
+ * returns how many of the bytes were data
+ */
+size_t write_holes(int outfile, const char *buf, size_t n, off_t pos,
+                   off_t allocated) {
+    size_t i = 0, start, step, data = 0;
+    off_t end;
+    ssize_t w;
+    int zero;
+
+    while (i < n) {
+        /* find the run of data or of zeros starting here */
+        start = i;
+        zero = zero_block(buf + i, n - i);
+        do {
+            step = n - i < HOLE_BLOCK ? n - i : HOLE_BLOCK;
+            i += step;
+        } while (i < n && zero_block(buf + i, n - i) == zero);
+
+        if (zero) {
+            /* a filesystem that can't punch just keeps zeros there */
+            if (pos + start < allocated) {
+                end = pos + i < allocated ? pos + i : allocated;
+                fallocate(outfile, FALLOC_FL_PUNCH_HOLE |
+                            FALLOC_FL_KEEP_SIZE, pos + start,
+                            end - (pos + start));
+            }
+            continue;
+        }
+        data += i - start;
+        while (start < i) {
+            if ((w = pwrite(outfile, buf + start, i - start,
+                                        pos + start)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("mytar");
+            }
+            start += w;
+        }
+    }
+    return data;
+}
+
+/*
+ * copy len bytes of archive into outfile at pos through a buffer,
+ * leaving holes where the data is zeros (see write_holes)
+ * the bytes come from offset in the archive, or from where it is read
+ * up to if offset is -1 (only the thread reading the archive does that)
+ * outfile is made pos + len bytes long first, so one that ends in zeros
+ * needs nothing written there
+ * space is allocated ahead of the writes, in windows that double while
+ * the data keeps coming, so a big file is laid out in a few pieces; none
+ * is while it's mostly zeros, so the holes of an image aren't allocated
+ * just to be punched out again
+ * the reading thread goes through in->buf (freed by in_close whatever
+ * happens), the others each through a buffer of their own
+ */
+void in_copy_holes(struct archive_in *in, off_t offset, int outfile,
+                   off_t len, off_t pos) {
+    char *buf, *own = NULL;
+    size_t chunk, data, ahead = ALLOC_AHEAD_MIN;
+    off_t end = pos + len, allocated = pos, want;
+    ssize_t n;
+    int alloc = 1;
+
+    if (ftruncate(outfile, end) == -1) {
+        fail("mytar");
+    }
+    if (offset == -1) {
+        if (in->buf == NULL && (in->buf = malloc(IN_COPY_BUF)) == NULL) {
+            fail("mytar");
+        }
+        buf = in->buf;
+    } else if ((buf = own = malloc(IN_COPY_BUF)) == NULL) {
+        fail("mytar");
+    }
+    while (len > 0) {
+        chunk = len < IN_COPY_BUF ? len : IN_COPY_BUF;
+        if (offset == -1) {
+            n = in_read(in, buf, chunk);
+        } else if ((n = pread(in->fd, buf, chunk, offset)) > 0) {
+            offset += n;
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(own);
+            fail("mytar");
+        }
+        if (n == 0) {
+            free(own);
+            fail_msg("error: currupted archive");
+        }
+        data = write_holes(outfile, buf, n, pos, allocated);
+        pos += n;
+        len -= n;
+
+        /* mostly zeros, allocate nothing more until data comes back */
+        if (data * 2 < (size_t)n) {
+            ahead = ALLOC_AHEAD_MIN;
+            continue;
+        }
+        want = pos + (off_t)ahead < end ? pos + (off_t)ahead : end;
+        if (alloc && want > (allocated > pos ? allocated : pos)) {
+            if (allocated < pos) {
+                allocated = pos;
+            }
+            /* a filesystem that can't just gets the writes */
+            if (fallocate(outfile, 0, allocated, want - allocated) == -1) {
+                alloc = 0;
+            } else {
+                allocated = want;
+            }
+        }
+        if (ahead < ALLOC_AHEAD_MAX) {
+            ahead *= 2;
+        }
+    }
+    free(own);
+}
+
+/*
+ * share the whole ALIGN_SIZE blocks of the len bytes of archive at offset
+ * with the start of outfile instead of copying them, if the filesystem
+ * can (btrfs, XFS) and the data is aligned (create --align)
+ * returns how many bytes were cloned, outfile is left just after them
+ */
+off_t in_clone_at(struct archive_in *in, off_t offset, int outfile, off_t len) {
+    struct file_clone_range range;
+
+    if (__atomic_load_n(&no_clone, __ATOMIC_RELAXED) ||
+            offset % ALIGN_SIZE != 0 || len < ALIGN_SIZE) {
+        return 0;
+    }
+    range.src_fd = in->fd;
+    range.src_offset = offset;
+    range.src_length = len / ALIGN_SIZE * ALIGN_SIZE;
+    range.dest_offset = 0;
+    if (ioctl(outfile, FICLONERANGE, &range) == -1) {
+        /* nothing else will clone either */
+        if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY ||
+                errno == ENOSYS) {
+            __atomic_store_n(&no_clone, 1, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+    if (lseek(outfile, range.src_length, SEEK_SET) == -1) {
+        fail("mytar");
+    }
+    return range.src_length;
+}
+
+/*
+ * copy len bytes of archive starting at offset into outfile
+ * leaves the archive's own position alone, so threads can call it
+ * on the same archive at once
+ */
+void in_copy_at(struct archive_in *in, off_t offset, int outfile, off_t len) {
+    char *buf = NULL;
+    size_t chunk;
+    ssize_t n;
+
+    while (len > 0) {
+        chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+
+        /* the kernel moves offset along itself */
+        n = kernel_copy(in->fd, &offset, outfile, chunk);
+        if (n == KERNEL_NO_COPY) {
+            if (buf == NULL && (buf = malloc(IN_COPY_BUF)) == NULL) {
+                fail("mytar");
+            }
+            if (chunk > IN_COPY_BUF) {
+                chunk = IN_COPY_BUF;
+            }
+            if ((n = pread(in->fd, buf, chunk, offset)) > 0) {
+                write_all(outfile, buf, n);
+                offset += n;
+            }
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buf);
+            fail("mytar");
+        }
+        if (n == 0) {
+            free(buf);
+            fail_msg("error: currupted archive");
+        }
+        len -= n;
+    }
+    free(buf);
+}
+
+/*
+ * done reading (the fd stays open)
+ */
+void in_close(struct archive_in *in) {
+    if (in->dec != NULL) {
+        decomp_close(in->dec);
+    }
+    if (in->map != NULL) {
+        munmap(in->map, in->maplen);
+    }
+    free(in->buf);
+    free(in);
+}
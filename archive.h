@@ -0,0 +1,67 @@
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include <sys/types.h>
+
+#include "util.h"
+
+/* blocks per record when -b is not given */
+#define DEFAULT_BLOCKING 128
+/* largest blocking factor -b will take (8 MiB records) */
+#define MAX_BLOCKING 16384
+
+/*
+ * buffered archive output
+ * headers and data are gathered into records of a fixed size
+ * and written out a whole record at a time
+ */
+struct archive_out {
+    int fd;
+    char *buf;          /* the record being filled */
+    size_t record;      /* bytes in a full record */
+    size_t len;         /* bytes waiting in buf */
+    off_t pos;          /* bytes put into the archive so far */
+    int pad_last;       /* pad the last record out to a full one */
+    int direct;         /* fd is a regular file, the kernel can copy to it */
+    struct compressor *comp;    /* records go through here if compressing */
+};
+
+/*
+ * archive input, decompressed on the fly if it needs to be
+ * uncompressed archives are read straight from fd
+ */
+struct archive_in {
+    int fd;
+    int method;         /* COMP_NONE, COMP_GZIP or COMP_ZSTD */
+    struct decompressor *dec;
+    char peek[BLOCK];   /* bytes read to find the method, not handed out */
+    size_t npeek;
+    size_t peekpos;
+    char *buf;          /* for in_copy when the kernel can't copy */
+    char *map;          /* the whole archive, when in_map could map it */
+    off_t maplen;
+    off_t mappos;       /* how far reading the map has got */
+};
+
+struct archive_out *out_open(int fd, int blocking, int pad_last,
+                                int method, int threads);
+void out_write(struct archive_out *out, const void *data, size_t n);
+void out_zeros(struct archive_out *out, size_t n);
+off_t out_copy(struct archive_out *out, int infile, off_t len);
+void out_flush(struct archive_out *out);
+void out_close(struct archive_out *out);
+void out_free(struct archive_out *out);
+
+struct archive_in *in_open(int fd);
+void in_map(struct archive_in *in);
+ssize_t in_read(struct archive_in *in, void *buf, size_t n);
+void in_skip(struct archive_in *in, off_t n);
+void in_copy(struct archive_in *in, int outfile, off_t len);
+off_t in_offset(struct archive_in *in);
+int in_seek(struct archive_in *in, off_t offset);
+off_t in_clone_at(struct archive_in *in, off_t offset, int outfile, off_t len);
+void in_copy_at(struct archive_in *in, off_t offset, int outfile, off_t len);
+void in_copy_holes(struct archive_in *in, off_t offset, int outfile,
+                   off_t len, off_t pos);
+void in_close(struct archive_in *in);
+#endif
@@ -0,0 +1,310 @@
+/*
+ * file: bench/codec_bench.c
+ *
+ * checks codec.c against the code it replaced, then times both
+ *
+ * every checksum path this cpu has (AVX2, SSE2, scalar and whichever
+ * calculate_checksum picks) is compared with the old byte at a time loop,
+ * and put_number/get_number with the old sprintf and digit loop versions,
+ * on edge cases and random blocks. Any difference is printed and the exit
+ * status is 1, so `make bench` fails before it prints any numbers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
+#include "codec.h"
+
+#define NBLOCKS 1024
+#define NNUMBERS 200000
+#define ROUNDS 2000000
+
+static unsigned char blocks[NBLOCKS][BLOCK];
+
+/*
+ * the checksum as it was before codec.c
+ */
+int old_checksum(unsigned char *head) {
+    int i, sum = 0;
+
+    for (i = 0; i < BLOCK; i++) {
+        if (i < CHKSUM_BEGIN || i > CHKSUM_END) {
+            sum += head[i];
+        } else {
+            sum += ' ';
+        }
+    }
+    return sum;
+}
+
+/*
+ * get_number as it was before codec.c
+ */
+int64_t old_get_number(const char *where, int len) {
+    int64_t val = 0;
+    int i = 0;
+
+    if (where[0] & 0x80) {
+        return extract_special_int(where, len);
+    }
+    while (i < len && where[i] == ' ') {
+        i++;
+    }
+    for (; i < len && where[i] >= '0' && where[i] <= '7'; i++) {
+        val = (val << 3) | (where[i] - '0');
+    }
+    return val;
+}
+
+/*
+ * put_number as it was before codec.c
+ */
+int old_put_number(char *where, size_t size, int64_t val) {
+    if (val >= 0 && ((size - 1) * 3 >= 64 ||
+                        (uint64_t)val >> ((size - 1) * 3) == 0)) {
+        sprintf(where, "%0*llo", (int)size - 1, (unsigned long long)val);
+        return 0;
+    }
+    return insert_special_int(where, size, val);
+}
+
+double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * 64 random bits, rand only promises 15 at a time
+ */
+uint64_t random64(void) {
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        val = (val << 15) ^ (uint64_t)rand();
+    }
+    return val;
+}
+
+/*
+ * returns the number of blocks some checksum path gets wrong
+ */
+int check_checksums(void) {
+    unsigned sum;
+    int i, j, bad = 0;
+
+    for (i = 0; i < NBLOCKS; i++) {
+        sum = 0;
+        for (j = 0; j < BLOCK; j++) {
+            sum += blocks[i][j];
+        }
+        if (calculate_checksum(blocks[i]) != old_checksum(blocks[i])) {
+            printf("calculate_checksum: wrong for block %d\n", i);
+            bad++;
+        }
+        if (sum_block_scalar(blocks[i]) != sum) {
+            printf("sum_block_scalar: wrong for block %d\n", i);
+            bad++;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("sse2") &&
+                sum_block_sse2(blocks[i]) != sum) {
+            printf("sum_block_sse2: wrong for block %d\n", i);
+            bad++;
+        }
+        if (__builtin_cpu_supports("avx2") &&
+                sum_block_avx2(blocks[i]) != sum) {
+            printf("sum_block_avx2: wrong for block %d\n", i);
+            bad++;
+        }
+#endif
+    }
+    return bad;
+}
+
+/*
+ * put val in both ways into a field of size bytes and read it back
+ * returns 1 if anything differs
+ */
+int check_number(int64_t val, size_t size) {
+    char old[12], new[12];
+    int oldret, newret;
+
+    memset(old, 'x', sizeof(old));
+    memset(new, 'x', sizeof(new));
+    oldret = old_put_number(old, size, val);
+    newret = put_number(new, size, val);
+    if (oldret != newret || (oldret == 0 && memcmp(old, new, size) != 0)) {
+        printf("put_number: %lld in %d bytes differs\n", (long long)val,
+               (int)size);
+        return 1;
+    }
+    if (newret == 0 && get_number(new, size) != old_get_number(new, size)) {
+        printf("get_number: %lld in %d bytes differs\n", (long long)val,
+               (int)size);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * returns the number of fields the number codec gets wrong
+ */
+int check_numbers(void) {
+    static const int64_t edges[] = {
+        0, 1, 7, 8, 077, 0100, 07777777, 010000000, 077777777777LL,
+        0100000000000LL, INT64_MAX, -1, INT64_MIN
+    };
+    char field[12];
+    int64_t val;
+    int i, j, bad = 0;
+
+    for (i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++) {
+        bad += check_number(edges[i], ID_SIZE);
+        bad += check_number(edges[i], SIZE_SIZE);
+    }
+    for (i = 0; i < NNUMBERS; i++) {
+        /* all sizes of number, not just the huge ones */
+        val = (int64_t)(random64() >> (rand() % 64));
+        bad += check_number(val, ID_SIZE);
+        bad += check_number(val, SIZE_SIZE);
+        bad += check_number(val & ID_MAX, ID_SIZE);
+    }
+
+    /* fields from other tars: spaces, no nul, junk after the digits */
+    for (i = 0; i < NNUMBERS; i++) {
+        for (j = 0; j < (int)sizeof(field); j++) {
+            field[j] = " 01234567\0x9"[rand() % 12];
+        }
+        if (get_number(field, sizeof(field)) !=
+                    old_get_number(field, sizeof(field))) {
+            printf("get_number: differs for \"%.12s\"\n", field);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/*
+ * time one checksum path over the blocks, in blocks per second
+ */
+void time_checksum(char *name, unsigned (*sum)(const unsigned char *)) {
+    volatile unsigned sink = 0;
+    double start = now();
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        sink += sum(blocks[i % NBLOCKS]);
+    }
+    printf("checksum %-8s %8.2f M/s\n", name, ROUNDS / (now() - start) / 1e6);
+}
+
+unsigned old_sum(const unsigned char *head) {
+    return old_checksum((unsigned char *)head);
+}
+
+unsigned new_sum(const unsigned char *head) {
+    return calculate_checksum((unsigned char *)head);
+}
+
+/*
+ * time writing then reading back the numbers of a header
+ * (mode uid gid size mtime chksum), old way and new
+ */
+void time_header(void) {
+    struct tarheader h;
+    volatile long long sink = 0;
+    double start;
+    int i;
+
+    memset(&h, 0, sizeof(h));
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        sprintf(h.mode, "%07o", i & 0777);
+        sprintf(h.uid, "%07o", 1000);
+        sprintf(h.gid, "%07o", 1000);
+        sprintf(h.size, "%011llo", (unsigned long long)i * 77);
+        sprintf(h.mtime, "%011llo", 1700000000ULL + i);
+        sprintf(h.chksum, "%07o", old_checksum((unsigned char *)&h));
+    }
+    printf("encode   old      %8.2f M headers/s\n",
+           ROUNDS / (now() - start) / 1e6);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        put_number(h.mode, ID_SIZE, i & 0777);
+        put_number(h.uid, ID_SIZE, 1000);
+        put_number(h.gid, ID_SIZE, 1000);
+        put_number(h.size, SIZE_SIZE, (int64_t)i * 77);
+        put_number(h.mtime, MTIME_SIZE, 1700000000LL + i);
+        put_number(h.chksum, ID_SIZE, calculate_checksum(
+                    (unsigned char *)&h));
+    }
+    printf("encode   new      %8.2f M headers/s\n",
+           ROUNDS / (now() - start) / 1e6);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        sink += strtol(h.mode, NULL, OCTAL) + strtol(h.uid, NULL, OCTAL) +
+                strtol(h.gid, NULL, OCTAL) + strtoll(h.size, NULL, OCTAL) +
+                strtoll(h.mtime, NULL, OCTAL) +
+                (strtol(h.chksum, NULL, OCTAL) ==
+                 old_checksum((unsigned char *)&h));
+    }
+    printf("decode   old      %8.2f M headers/s\n",
+           ROUNDS / (now() - start) / 1e6);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        sink += get_number(h.mode, ID_SIZE) + get_number(h.uid, ID_SIZE) +
+                get_number(h.gid, ID_SIZE) + get_number(h.size, SIZE_SIZE) +
+                get_number(h.mtime, MTIME_SIZE) +
+                (get_number(h.chksum, ID_SIZE) ==
+                 calculate_checksum((unsigned char *)&h));
+    }
+    printf("decode   new      %8.2f M headers/s\n",
+           ROUNDS / (now() - start) / 1e6);
+}
+
+int main(void) {
+    int i, j, bad;
+
+    /* the first blocks are the extremes, the rest random */
+    srand(1);
+    memset(blocks[1], 0xff, BLOCK);
+    for (i = 0; i < BLOCK; i++) {
+        blocks[2][i] = i & 1 ? 0xff : 0;
+    }
+    for (i = 3; i < NBLOCKS; i++) {
+        for (j = 0; j < BLOCK; j++) {
+            blocks[i][j] = rand();
+        }
+    }
+
+    bad = check_checksums() + check_numbers();
+    if (bad > 0) {
+        printf("%d mismatches with the old code\n", bad);
+        return 1;
+    }
+    printf("codec matches the old code\n");
+
+    time_checksum("old", old_sum);
+    time_checksum("scalar", sum_block_scalar);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) {
+        time_checksum("sse2", sum_block_sse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        time_checksum("avx2", sum_block_avx2);
+    }
+#endif
+    time_checksum("new", new_sum);
+    time_header();
+    return 0;
+}
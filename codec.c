@@ -0,0 +1,221 @@
+/*
+ * file: codec.c
+ *
+ * header checksums and numeric header fields, which every member goes
+ * through on create, list and extract
+ *
+ * the checksum is summed 16 or 32 bytes at a time with SSE2 or AVX2 where
+ * the cpu has them, and numbers are turned into octal digits (and back)
+ * with tables instead of sprintf and strtol
+ */
+
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "util.h"
+#include "codec.h"
+
+/* the octal digits of 0 to 077, two to an entry */
+static const char octal_pairs[] =
+    "0001020304050607" "1011121314151617" "2021222324252627"
+    "3031323334353637" "4041424344454647" "5051525354555657"
+    "6061626364656667" "7071727374757677";
+
+/* the value of each octal digit, -1 for anything that isn't one */
+static const signed char octal_digits[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * sum of the BLOCK bytes at head, 32 at a time
+ * psadbw against zero adds up each 8 bytes into a 64-bit lane
+ */
+__attribute__((target("avx2")))
+unsigned sum_block_avx2(const unsigned char *head) {
+    __m256i sum = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+    __m128i half;
+    int i;
+
+    for (i = 0; i < BLOCK; i += 32) {
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(
+                _mm256_loadu_si256((const __m256i *)(head + i)), zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                         _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+    return (unsigned)_mm_cvtsi128_si32(half);
+}
+
+/*
+ * sum of the BLOCK bytes at head, 16 at a time
+ */
+__attribute__((target("sse2")))
+unsigned sum_block_sse2(const unsigned char *head) {
+    __m128i sum = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < BLOCK; i += 16) {
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(
+                _mm_loadu_si128((const __m128i *)(head + i)), zero));
+    }
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return (unsigned)_mm_cvtsi128_si32(sum);
+}
+#endif
+
+/*
+ * sum of the BLOCK bytes at head, a 64-bit word at a time: the bytes of
+ * each word are split into two words of 16-bit lanes, which can't
+ * overflow in the 64 words of a block
+ */
+unsigned sum_block_scalar(const unsigned char *head) {
+    uint64_t word, lanes = 0;
+    int i;
+
+    for (i = 0; i < BLOCK; i += 8) {
+        memcpy(&word, head + i, 8);
+        lanes += word & 0x00ff00ff00ff00ffULL;
+        lanes += (word >> 8) & 0x00ff00ff00ff00ffULL;
+    }
+    lanes = (lanes & 0xffff) + ((lanes >> 16) & 0xffff) +
+            ((lanes >> 32) & 0xffff) + (lanes >> 48);
+    return (unsigned)lanes;
+}
+
+/*
+ * calculate the chksum field for the header
+ * everything is summed, then the chksum field is taken back out and
+ * counted as the spaces it's meant to be, so there's no test per byte
+ */
+int calculate_checksum(unsigned char *head) {
+    unsigned sum;
+    int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        sum = sum_block_avx2(head);
+    } else if (__builtin_cpu_supports("sse2")) {
+        sum = sum_block_sse2(head);
+    } else {
+        sum = sum_block_scalar(head);
+    }
+#else
+    sum = sum_block_scalar(head);
+#endif
+
+    for (i = CHKSUM_BEGIN; i <= CHKSUM_END; i++) {
+        sum += ' ' - head[i];
+    }
+    return (int)sum;
+}
+
+/*
+ * GNU tar stores numbers too big for their octal field in base-256:
+ * the high-order bit of the first byte is set and the whole field is
+ * a big-endian two's complement integer (0xff first for negatives)
+ * returns the value, all 64 bits of it
+ */
+int64_t extract_special_int(const char *where, int len) {
+    uint64_t val;
+    int i;
+
+    /* negative numbers are sign extended from the first byte */
+    val = (where[0] & 0x40) ? ~(uint64_t)0 : 0;
+    val = (val << 6) | (where[0] & 0x3f);
+    for (i = 1; i < len; i++) {
+        val = (val << 8) | (unsigned char)where[i];
+    }
+    return (int64_t)val;
+}
+
+/*
+ * put val into the field as a GNU base-256 number
+ * returns 0 on success, nonzero if it doesn't fit
+ */
+int insert_special_int(char *where, size_t size, int64_t val) {
+    int i;
+
+    /* with the flag bit taken, short fields only hold positive numbers */
+    if (size < sizeof(val) + 1 &&
+                (val < 0 || (uint64_t)val >> (size * 8 - 1) != 0)) {
+        return 1;
+    }
+
+    /* negative numbers are sign extended across the field */
+    memset(where, val < 0 ? 0xff : 0, size);
+    for (i = size - 1; i >= 0 && i >= (int)size - (int)sizeof(val); i--) {
+        where[i] = val & 0xff;
+        val >>= 8;
+    }
+    *where |= 0x80; /* set that high-order bit */
+    return 0;
+}
+
+/*
+ * reads a numeric header field, octal or base-256
+ * the octal digits may fill the field with no nul after them
+ */
+int64_t get_number(const char *where, int len) {
+    const unsigned char *p = (const unsigned char *)where;
+    int64_t val = 0;
+    int i = 0;
+
+    if (where[0] & 0x80) {
+        return extract_special_int(where, len);
+    }
+
+    /* leading spaces are allowed, then digits up to a space or nul */
+    while (i < len && p[i] == ' ') {
+        i++;
+    }
+    for (; i < len && octal_digits[p[i]] >= 0; i++) {
+        val = (val << 3) | octal_digits[p[i]];
+    }
+    return val;
+}
+
+/*
+ * writes val into a numeric header field as zero padded octal,
+ * or base-256 if it needs more digits than the field has
+ * returns 0 on success, nonzero if it can't be stored
+ */
+int put_number(char *where, size_t size, int64_t val) {
+    uint64_t u = (uint64_t)val;
+    int i;
+
+    /* size - 1 octal digits fit, the last byte is the nul */
+    if (val < 0 || ((size - 1) * 3 < 64 && u >> ((size - 1) * 3) != 0)) {
+        return insert_special_int(where, size, val);
+    }
+
+    /* two digits at a time from the right, the field is filled with
+     * them so the zero padding comes for free */
+    where[size - 1] = '\0';
+    for (i = size - 1; i >= 2; i -= 2) {
+        memcpy(where + i - 2, octal_pairs + (u & 077) * 2, 2);
+        u >>= 6;
+    }
+    if (i == 1) {
+        where[0] = '0' + (u & 07);
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int calculate_checksum(unsigned char *head);
+int insert_special_int(char *where, size_t size, int64_t val);
+int64_t extract_special_int(const char *where, int len);
+int64_t get_number(const char *where, int len);
+int put_number(char *where, size_t size, int64_t val);
+
+/* the ways calculate_checksum sums a block, bench/codec_bench.c checks them */
+unsigned sum_block_scalar(const unsigned char *head);
+#if defined(__x86_64__) || defined(__i386__)
+unsigned sum_block_sse2(const unsigned char *head);
+unsigned sum_block_avx2(const unsigned char *head);
+#endif
+#endif
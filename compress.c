@@ -0,0 +1,477 @@
+/*
+ * file: compress.c
+ *
+ * gzip (z) and zstd (Z) compression of the archive stream
+ *
+ * compression splits the stream into chunks and compresses each one on
+ * its own, on a pool of threads (like pigz). Every chunk becomes a
+ * complete gzip member or zstd frame, and both formats allow those to be
+ * concatenated, so gzip/zstd/tar can read the result like any other.
+ * The chunks are written out in order no matter which thread finishes
+ * first.
+ *
+ * decompression is a plain stream, it reads any gzip or zstd file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "util.h"
+#include "compress.h"
+
+#define GZIP_LEVEL 6
+#define ZSTD_LEVEL 3
+/* compressed bytes read at a time when decompressing */
+#define RAW_BUF (256 * 1024)
+/* chunks in flight per compression thread */
+#define CHUNKS_PER_THREAD 2
+
+#define CHUNK_FREE 0
+#define CHUNK_QUEUED 1
+#define CHUNK_DONE 2
+
+/* one piece of the stream on its way through a compression thread */
+struct comp_chunk {
+    char *in;
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    int state;
+};
+
+/*
+ * chunks are used round robin by sequence number, slot = seq % nchunks
+ * fill is the chunk taking data, chunks before it are queued or done
+ */
+struct compressor {
+    int fd;
+    int method;
+    struct comp_chunk *chunks;
+    int nchunks;
+    long fill;              /* seq of the chunk being filled */
+    long next;              /* next seq a thread compresses */
+    long written;           /* next seq to write out */
+    pthread_t *threads;
+    int nthreads;           /* 0 to compress as chunks fill up */
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+};
+
+struct decompressor {
+    int fd;
+    int method;
+    char *raw;              /* compressed input */
+    int eof;                /* nothing left in fd */
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zds;
+    ZSTD_inBuffer zin;
+#endif
+};
+
+/*
+ * compress one chunk into a gzip member
+ */
+void gzip_chunk(struct comp_chunk *ch) {
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 on the window bits asks for a gzip wrapper */
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK) {
+        fail_msg("mytar: gzip: %s", zs.msg ? zs.msg : "init");
+    }
+    if (ch->outcap < deflateBound(&zs, ch->inlen)) {
+        ch->outcap = deflateBound(&zs, ch->inlen);
+        if ((ch->out = realloc(ch->out, ch->outcap)) == NULL) {
+            fail("mytar");
+        }
+    }
+
+    zs.next_in = (unsigned char *)ch->in;
+    zs.avail_in = ch->inlen;
+    zs.next_out = (unsigned char *)ch->out;
+    zs.avail_out = ch->outcap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        fail_msg("mytar: gzip: %s", zs.msg ? zs.msg : "deflate");
+    }
+    ch->outlen = zs.total_out;
+    deflateEnd(&zs);
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * compress one chunk into a zstd frame
+ */
+void zstd_chunk(struct comp_chunk *ch) {
+    size_t n;
+
+    if (ch->outcap < ZSTD_compressBound(ch->inlen)) {
+        ch->outcap = ZSTD_compressBound(ch->inlen);
+        if ((ch->out = realloc(ch->out, ch->outcap)) == NULL) {
+            fail("mytar");
+        }
+    }
+    n = ZSTD_compress(ch->out, ch->outcap, ch->in, ch->inlen, ZSTD_LEVEL);
+    if (ZSTD_isError(n)) {
+        fail_msg("mytar: zstd: %s", ZSTD_getErrorName(n));
+    }
+    ch->outlen = n;
+}
+#endif
+
+void compress_chunk(int method, struct comp_chunk *ch) {
+#ifdef HAVE_ZSTD
+    if (method == COMP_ZSTD) {
+        zstd_chunk(ch);
+        return;
+    }
+#endif
+    gzip_chunk(ch);
+}
+
+void *comp_thread(void *arg) {
+    struct compressor *c = (struct compressor *)arg;
+    struct comp_chunk *ch;
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        if (c->next == c->fill) {
+            if (c->done) {
+                break;
+            }
+            pthread_cond_wait(&c->work, &c->lock);
+            continue;
+        }
+        ch = &c->chunks[c->next++ % c->nchunks];
+        pthread_mutex_unlock(&c->lock);
+
+        compress_chunk(c->method, ch);
+
+        pthread_mutex_lock(&c->lock);
+        ch->state = CHUNK_DONE;
+        pthread_cond_broadcast(&c->finished);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/*
+ * write out the oldest chunk, waiting for it to be compressed
+ * called with the lock held
+ */
+void write_oldest(struct compressor *c) {
+    struct comp_chunk *ch = &c->chunks[c->written % c->nchunks];
+
+    while (ch->state != CHUNK_DONE) {
+        pthread_cond_wait(&c->finished, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    write_all(c->fd, ch->out, ch->outlen);
+    pthread_mutex_lock(&c->lock);
+
+    ch->inlen = 0;
+    ch->state = CHUNK_FREE;
+    c->written++;
+}
+
+/*
+ * hand the chunk being filled off to be compressed
+ * and make sure the next one is free to fill
+ */
+void submit_chunk(struct compressor *c) {
+    struct comp_chunk *ch = &c->chunks[c->fill % c->nchunks];
+
+    if (c->nthreads == 0) {
+        compress_chunk(c->method, ch);
+        write_all(c->fd, ch->out, ch->outlen);
+        ch->inlen = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    ch->state = CHUNK_QUEUED;
+    c->fill++;
+    pthread_cond_signal(&c->work);
+
+    /* the slot we fill next still holds an old chunk */
+    while (c->fill - c->written >= c->nchunks) {
+        write_oldest(c);
+    }
+    /* write anything else that's ready while we're here */
+    while (c->written < c->fill &&
+            c->chunks[c->written % c->nchunks].state == CHUNK_DONE) {
+        write_oldest(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * start compressing everything written to fd
+ * threads is how many chunks are compressed at once
+ */
+struct compressor *comp_open(int fd, int method, int threads) {
+    struct compressor *c;
+    int i;
+
+#ifndef HAVE_ZSTD
+    if (method == COMP_ZSTD) {
+        fail_msg("mytar: built without zstd support");
+    }
+#endif
+
+    if ((c = calloc(1, sizeof(struct compressor))) == NULL) {
+        fail("mytar");
+    }
+    c->fd = fd;
+    c->method = method;
+    c->nthreads = threads > 1 ? threads : 0;
+    c->nchunks = c->nthreads ? c->nthreads * CHUNKS_PER_THREAD : 1;
+    if ((c->chunks = calloc(c->nchunks, sizeof(struct comp_chunk))) == NULL) {
+        fail("mytar");
+    }
+    for (i = 0; i < c->nchunks; i++) {
+        if ((c->chunks[i].in = malloc(COMP_CHUNK)) == NULL) {
+            fail("mytar");
+        }
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    pthread_cond_init(&c->finished, NULL);
+    if (c->nthreads) {
+        if ((c->threads = malloc(c->nthreads * sizeof(pthread_t))) == NULL) {
+            fail("mytar");
+        }
+        for (i = 0; i < c->nthreads; i++) {
+            if ((errno = pthread_create(&c->threads[i], NULL,
+                                        comp_thread, c))) {
+                fail("mytar");
+            }
+        }
+    }
+    return c;
+}
+
+/*
+ * add n bytes of the archive to the compressed stream
+ */
+void comp_write(struct compressor *c, const char *data, size_t n) {
+    struct comp_chunk *ch;
+    size_t take;
+
+    while (n > 0) {
+        ch = &c->chunks[c->fill % c->nchunks];
+        take = COMP_CHUNK - ch->inlen;
+        if (take > n) {
+            take = n;
+        }
+        memcpy(ch->in + ch->inlen, data, take);
+        ch->inlen += take;
+        data += take;
+        n -= take;
+        if (ch->inlen == COMP_CHUNK) {
+            submit_chunk(c);
+        }
+    }
+}
+
+/*
+ * stop the threads and free c, dropping anything not written out
+ */
+void comp_free(struct compressor *c) {
+    int i;
+
+    pthread_mutex_lock(&c->lock);
+    c->done = 1;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->lock);
+
+    for (i = 0; i < c->nthreads; i++) {
+        pthread_join(c->threads[i], NULL);
+    }
+    for (i = 0; i < c->nchunks; i++) {
+        free(c->chunks[i].in);
+        free(c->chunks[i].out);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->finished);
+    free(c->threads);
+    free(c->chunks);
+    free(c);
+}
+
+/*
+ * compress and write out whatever is left, then stop the threads
+ */
+void comp_close(struct compressor *c) {
+    if (c->chunks[c->fill % c->nchunks].inlen > 0) {
+        submit_chunk(c);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while (c->written < c->fill) {
+        write_oldest(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+    comp_free(c);
+}
+
+/*
+ * what the first bytes of a file say it is compressed with
+ */
+int comp_detect(const unsigned char *magic, size_t n) {
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMP_GZIP;
+    }
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+            magic[2] == 0x2f && magic[3] == 0xfd) {
+        return COMP_ZSTD;
+    }
+    return COMP_NONE;
+}
+
+/*
+ * start decompressing fd
+ * start holds nstart bytes already read from the front of it
+ */
+struct decompressor *decomp_open(int fd, int method,
+                                const char *start, size_t nstart) {
+    struct decompressor *d;
+
+#ifndef HAVE_ZSTD
+    if (method == COMP_ZSTD) {
+        fail_msg("mytar: built without zstd support");
+    }
+#endif
+
+    if ((d = calloc(1, sizeof(struct decompressor))) == NULL ||
+            (d->raw = malloc(RAW_BUF)) == NULL) {
+        fail("mytar");
+    }
+    d->fd = fd;
+    d->method = method;
+    memcpy(d->raw, start, nstart);
+
+#ifdef HAVE_ZSTD
+    if (method == COMP_ZSTD) {
+        if ((d->zds = ZSTD_createDStream()) == NULL) {
+            fail_msg("mytar: zstd: out of memory");
+        }
+        ZSTD_initDStream(d->zds);
+        d->zin.src = d->raw;
+        d->zin.size = nstart;
+        d->zin.pos = 0;
+        return d;
+    }
+#endif
+
+    /* 32 on the window bits takes gzip or zlib headers */
+    if (inflateInit2(&d->zs, 15 + 32) != Z_OK) {
+        fail_msg("mytar: gzip: %s", d->zs.msg ? d->zs.msg : "init");
+    }
+    d->zs.next_in = (unsigned char *)d->raw;
+    d->zs.avail_in = nstart;
+    return d;
+}
+
+/*
+ * read more compressed input, returns how much
+ */
+size_t fill_raw(struct decompressor *d) {
+    ssize_t n;
+
+    if (d->eof) {
+        return 0;
+    }
+    while ((n = read(d->fd, d->raw, RAW_BUF)) == -1) {
+        if (errno != EINTR) {
+            fail("mytar");
+        }
+    }
+    if (n == 0) {
+        d->eof = 1;
+    }
+    return n;
+}
+
+#ifdef HAVE_ZSTD
+ssize_t zstd_read(struct decompressor *d, char *buf, size_t n) {
+    ZSTD_outBuffer zout = { buf, n, 0 };
+    size_t ret;
+
+    while (zout.pos < zout.size) {
+        if (d->zin.pos == d->zin.size) {
+            d->zin.size = fill_raw(d);
+            d->zin.pos = 0;
+            if (d->zin.size == 0) {
+                break;
+            }
+        }
+        ret = ZSTD_decompressStream(d->zds, &zout, &d->zin);
+        if (ZSTD_isError(ret)) {
+            fail_msg("mytar: zstd: %s", ZSTD_getErrorName(ret));
+        }
+    }
+    return zout.pos;
+}
+#endif
+
+ssize_t gzip_read(struct decompressor *d, char *buf, size_t n) {
+    int ret;
+
+    d->zs.next_out = (unsigned char *)buf;
+    d->zs.avail_out = n;
+    while (d->zs.avail_out > 0) {
+        if (d->zs.avail_in == 0) {
+            d->zs.next_in = (unsigned char *)d->raw;
+            if ((d->zs.avail_in = fill_raw(d)) == 0) {
+                break;
+            }
+        }
+        ret = inflate(&d->zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* another member may follow, each chunk is its own */
+            inflateReset(&d->zs);
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fail_msg("mytar: gzip: %s",
+                    d->zs.msg ? d->zs.msg : "currupted data");
+        }
+    }
+    return n - d->zs.avail_out;
+}
+
+/*
+ * read up to n bytes of decompressed archive
+ * only comes up short at the end of the stream
+ */
+ssize_t decomp_read(struct decompressor *d, char *buf, size_t n) {
+#ifdef HAVE_ZSTD
+    if (d->method == COMP_ZSTD) {
+        return zstd_read(d, buf, n);
+    }
+#endif
+    return gzip_read(d, buf, n);
+}
+
+void decomp_close(struct decompressor *d) {
+#ifdef HAVE_ZSTD
+    if (d->method == COMP_ZSTD) {
+        ZSTD_freeDStream(d->zds);
+    } else
+#endif
+    inflateEnd(&d->zs);
+    free(d->raw);
+    free(d);
+}
@@ -0,0 +1,26 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <sys/types.h>
+
+#define COMP_NONE 0
+#define COMP_GZIP 1     /* z */
+#define COMP_ZSTD 2     /* Z */
+
+/* uncompressed bytes in each independently compressed chunk */
+#define COMP_CHUNK (1024 * 1024)
+
+struct compressor;
+struct decompressor;
+
+struct compressor *comp_open(int fd, int method, int threads);
+void comp_write(struct compressor *c, const char *data, size_t n);
+void comp_close(struct compressor *c);
+void comp_free(struct compressor *c);
+
+int comp_detect(const unsigned char *magic, size_t n);
+struct decompressor *decomp_open(int fd, int method,
+                                const char *start, size_t nstart);
+ssize_t decomp_read(struct decompressor *d, char *buf, size_t n);
+void decomp_close(struct decompressor *d);
+#endif
@@ -14,6 +14,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -24,332 +25,1755 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
-#include "util.h"
+#include "create.h"
+#include "archive.h"
+#include "codec.h"
+#include "compress.h"
+#include "incremental.h"
+#include "index.h"
+#include "pax.h"
+#include "match.h"
+
+/* most bytes of a file that a reader thread reads ahead of the writer */
+#define PREFETCH_MAX (1024 * 1024)
+/* how many members each reader thread may have in flight */
+#define SLOTS_PER_JOB 4
+/* buckets in the uid/gid name caches */
+#define NAME_BUCKETS 64
+/* bytes of directory entries the walker reads at once */
+#define WALK_BUF (32 * 1024)
+/* most directories the walker keeps open (or a quarter of the fd limit,
+ * if that's less), the ones above them are read in whole and let go of
+ * until the walk gets back to them */
+#define WALK_FDS_MAX 128
 
 /*
- * write two 0 blocks to signal the end of the archive as per specification
- *
+ * a directory the walker has open, shared with the members found in it
+ * so readers can stat and open them relative to it
+ * closed when the walker and all of those members are done with it
+ */
+struct dir_handle {
+    int fd;
+    int refs;
+};
+
+/*
+ * one path on its way into the archive
+ * the walker finds it, a reader stats/opens/reads it, the writer writes it
+ */
+struct member {
+    char *path;             /* name in the archive, dirs end in a slash */
+    struct dir_handle *dir; /* directory it's in, NULL for paths given */
+    char *name;             /* path relative to dir (part of path) */
+    struct stat st;
+    int have_stat;          /* walker already filled in st */
+    int err;                /* errno if the path could not be read */
+    int fd;                 /* still open regular file, -1 if none */
+    char *linkname;         /* target of a symlink, NULL otherwise */
+    char *data;             /* data read ahead, zero padded to a block */
+    size_t datalen;
+    off_t *map;             /* offset/size pairs of data in a sparse file */
+    int nmap;               /* pairs in map, 0 if the file isn't sparse */
+    int unchanged;          /* same as in the snapshot, leave it out */
+    int ready;              /* reader is done with it */
+};
+
+/*
+ * ring of members shared by the walker, the readers and the writer
+ * sequence numbers only grow; slot = seq % nslots
+ */
+struct queue {
+    struct member *slots;
+    int nslots;
+    long head;              /* next seq the walker fills */
+    long next;              /* next seq a reader claims */
+    long tail;              /* next seq the writer writes */
+    int done;               /* walker has queued everything */
+    pthread_mutex_t lock;
+    pthread_cond_t not_full, not_empty, ready;
+};
+
+/* a uid or gid we have already looked up */
+struct id_name {
+    unsigned long id;
+    char name[UGNAME_MAX];  /* empty if the id has no name */
+    struct id_name *next;
+};
+
+/* names of uids or gids, so each one is only looked up once */
+struct name_cache {
+    struct id_name *buckets[NAME_BUCKETS];
+    struct id_name *last;   /* most files share the previous owner */
+    char *buf;              /* for getpwuid_r/getgrgid_r, grown as needed */
+    size_t bufsize;
+};
+
+/* a file with more than one link, and the name it was archived under */
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+    struct link_entry *next;
+};
+
+/* every multiply linked file archived so far, keyed by device and inode */
+struct link_table {
+    struct link_entry **buckets;
+    size_t nbuckets;        /* a power of two */
+    size_t count;
+};
+
+/* an entry of a directory read in whole to be sorted (--sort) */
+struct walk_entry {
+    struct dirent64 *d;
+    unsigned long long key; /* inode or physical offset */
+    int index;              /* getdents order, to keep the sort stable */
+};
+
+/*
+ * one level of the walk: a directory and how far into it we are
+ * it has no dir while the walker has let go of it, then everything in
+ * it is looked at by path
+ */
+struct walk_frame {
+    struct dir_handle *dir;
+    char *buf;              /* entries from getdents64 */
+    int pos;
+    int len;
+    struct walk_entry *ents; /* the whole directory sorted, if sorting */
+    int nents;
+    int whole;              /* the rest of it is in buf (or ents) */
+    int err;                /* errno from reading it in whole */
+    size_t pathlen;         /* length of its path, with the slash */
+};
+
+/*
+ * where the walker is: the stack of directories it has open and the
+ * path it is on, kept in the ctx so they can be let go of if creating
+ * fails part way through
+ */
+struct walker {
+    struct walk_frame *stack;
+    int depth;
+    int cap;
+    int held;               /* frames with their directory open */
+    int maxheld;
+    char *path;
+    size_t pathcap;
+};
+
+/* state shared by the whole create run */
+struct create_ctx {
+    int fd;                 /* the archive */
+    struct archive_out *out;
+    struct options *opts;
+    struct queue *q;        /* NULL when running single threaded */
+    struct snapshot *snap;  /* NULL unless making an incremental (-g) */
+    struct index_out *index; /* NULL unless writing an index (--index) */
+    struct pax_out pax;     /* extended header records, writer only */
+    struct link_table links; /* hard links seen, writer only */
+    struct name_cache users; /* owner names for headers, writer only */
+    struct name_cache groups;
+    struct walker walker;
+    struct member cur;      /* being archived single threaded, if path */
+    char **paths;
+    int npaths;
+};
+
+/*
+ * returns the user (or group) name for an id, truncated to fit the header
+ * names come from the cache after the first lookup
+ * an id without a name gives "" so the header just has the number
+ */
+char *lookup_name(struct name_cache *cache, unsigned long id, int group) {
+    struct id_name *e;
+    struct passwd pwd, *pw = NULL;
+    struct group grp, *gr = NULL;
+    char *name = NULL;
+    int err;
+
+    if (cache->last != NULL && cache->last->id == id) {
+        return cache->last->name;
+    }
+    for (e = cache->buckets[id % NAME_BUCKETS]; e != NULL; e = e->next) {
+        if (e->id == id) {
+            cache->last = e;
+            return e->name;
+        }
+    }
+
+    /* the _r versions, other threads may be running a create of their
+     * own (libmytar), the buffer grows until the entry fits */
+    for (;;) {
+        if (cache->bufsize == 0) {
+            cache->bufsize = 1024;
+        }
+        if (cache->buf == NULL &&
+                (cache->buf = malloc(cache->bufsize)) == NULL) {
+            fail("mytar");
+        }
+        if (group) {
+            err = getgrgid_r(id, &grp, cache->buf, cache->bufsize, &gr);
+        } else {
+            err = getpwuid_r(id, &pwd, cache->buf, cache->bufsize, &pw);
+        }
+        if (err != ERANGE) {
+            break;
+        }
+        free(cache->buf);
+        cache->buf = NULL;
+        cache->bufsize *= 2;
+    }
+    if (gr != NULL) {
+        name = gr->gr_name;
+    } else if (pw != NULL) {
+        name = pw->pw_name;
+    }
+
+    if ((e = calloc(1, sizeof(struct id_name))) == NULL) {
+        fail("mytar");
+    }
+    e->id = id;
+    /* truncate name if necessary to fit within field */
+    if (name != NULL) {
+        strncpy(e->name, name, UGNAME_MAX - 1);
+    }
+
+    e->next = cache->buckets[id % NAME_BUCKETS];
+    cache->buckets[id % NAME_BUCKETS] = e;
+    cache->last = e;
+    return e->name;
+}
+
+/*
+ * empty out a name cache
  */
-void write_stop_blocks(int tarfile) {
-    char *stop_blocks;
+void free_names(struct name_cache *cache) {
+    struct id_name *e, *next;
     int i;
-    
-    /* two 512 byte blocks */
-    if ((stop_blocks = (char *)malloc(sizeof(char) * BLOCK*2)) == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+
+    for (i = 0; i < NAME_BUCKETS; i++) {
+        for (e = cache->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
     }
-    
-    /* zero out the blocks */
-    for (i = 0; i < BLOCK*2; i++) {
-        stop_blocks[i] = 0;
+    free(cache->buf);
+    memset(cache, 0, sizeof(struct name_cache));
+}
+
+size_t hash_inode(dev_t dev, ino_t ino) {
+    return (size_t)(ino * 0x9e3779b97f4a7c15ULL) ^ (size_t)dev;
+}
+
+/*
+ * returns the archived name of the file st is about, or NULL
+ */
+char *find_link(struct link_table *t, struct stat *st) {
+    struct link_entry *e;
+
+    if (t->count == 0) {
+        return NULL;
     }
-    
-    /* should be at the end of the file */
-    if (write(tarfile, stop_blocks, BLOCK*2) == -1) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    for (e = t->buckets[hash_inode(st->st_dev, st->st_ino) &
+                                (t->nbuckets - 1)]; e != NULL; e = e->next) {
+        if (e->ino == st->st_ino && e->dev == st->st_dev) {
+            return e->path;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * remember that the file st is about was archived as path
+ * doubles the buckets whenever there is more than one entry per bucket
+ */
+void add_link(struct link_table *t, struct stat *st, char *path) {
+    struct link_entry *e, *next, **buckets;
+    size_t i, n, nbuckets;
+
+    if (t->count >= t->nbuckets) {
+        nbuckets = t->nbuckets ? t->nbuckets * 2 : 1024;
+        if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL) {
+            fail("mytar");
+        }
+        for (i = 0; i < t->nbuckets; i++) {
+            for (e = t->buckets[i]; e != NULL; e = next) {
+                next = e->next;
+                n = hash_inode(e->dev, e->ino) & (nbuckets - 1);
+                e->next = buckets[n];
+                buckets[n] = e;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->nbuckets = nbuckets;
+    }
+
+    if ((e = malloc(sizeof(struct link_entry))) == NULL ||
+            (e->path = strdup(path)) == NULL) {
+        fail("mytar");
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    n = hash_inode(e->dev, e->ino) & (t->nbuckets - 1);
+    e->next = t->buckets[n];
+    t->buckets[n] = e;
+    t->count++;
+}
+
+void free_links(struct link_table *t) {
+    struct link_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < t->nbuckets; i++) {
+        for (e = t->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+    free(t->buckets);
+    memset(t, 0, sizeof(struct link_table));
+}
+
+/*
+ * write two 0 blocks to signal the end of the archive as per specification
+ *
+ */
+void write_stop_blocks(struct archive_out *out) {
+    /* two 512 byte blocks, should be at the end of the file */
+    out_zeros(out, BLOCK*2);
+}
+
+/*
+ * where to split a path between the prefix and name fields
+ * returns 0 if it fits in name alone, the index of the slash to split at,
+ * or -1 if it doesn't fit in a ustar header at all
+ */
+int split_path(char *path) {
+    size_t len = strlen(path);
+    size_t i;
+
+    if (len <= NAME_MAX_) {
+        return 0;
     }
 
-    free(stop_blocks);
+    /* the first slash that leaves a short enough name after it */
+    for (i = len - 1 - NAME_MAX_; i < len && path[i] != '/'; i++)
+        ;
+    if (i == 0 || i >= len - 1 || i > PREFIX_MAX) {
+        return -1;
+    }
+    return i;
 }
 
 /* 
  * populates the tarheader struct with all the file metadata needed
- *
+ * everything but the chksum, which put_header fills in
  */
-int write_header(int tarfile, char *path, struct stat *st, 
-                                int verbose, int strict) {
-    struct tarheader head;
-    struct passwd *pw;
-    struct group *gr;
+int build_header(struct create_ctx *ctx, struct tarheader *head, char *path,
+                                struct stat *st, char *linkname) {
+    struct options *opts = ctx->opts;
+    int strict = opts->strict;
     int i;
     
     /* create a clean slate in case we don't write in every position */
-    memset(&head, 0, BLOCK); 
-    
-    /* if v arg, list out the files as they are added */
-    if (verbose) {
-        printf("%s\n", path);
-    }
+    memset(head, 0, BLOCK); 
     
     /* if path fits into the name field put it there */
-    if (strlen(path) <= NAME_MAX_) {
-        strncpy(head.name, path, strlen(path));
+    if ((i = split_path(path)) == 0) {
+        strncpy(head->name, path, NAME_MAX_);
     /* else, we put the path into the prefix and filename in the name */
+    } else if (i > 0) {
+        strncpy(head->name, path + i + 1, NAME_MAX_);
+        strncpy(head->prefix, path, i);
+    /* too long for ustar, an extended header has the whole thing */
+    } else if (strict) {
+        report_msg("%s: path cannot be partitioned", path);
+        return -1;
     } else {
-        /* find the index to split the path by */
-        i = (strlen(path) - 1) - NAME_MAX_;
-        while (path[i] != '/') {
-            if (path[i] == 0) {
-               fprintf(stderr, "%s: path cannot be partitioned\n", path);
-               return -1;
-            }
-            i++;
-        }
-        strncpy(head.name, path + i + 1, NAME_MAX_);
-        strncpy(head.prefix, path, i);
+        strncpy(head->name, path, NAME_MAX_);
     }
     
-    /* populate uid field octal with the file uid */
-    if (st->st_uid > ID_MAX) {
-        /* if S arg, just throw an error
-         * else, just encode it as a regular binary number
-         */
-        if (strict) {
-            fprintf(stderr, "%s: uid too large\n", path);
-            return -1;
-        }
-        if (insert_special_int(head.uid, ID_SIZE, st->st_uid) == -1) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        /* sprintf helps us format it as a specific length octal */
-        sprintf(head.uid, "%07o", st->st_uid);
+    /* populate uid field octal with the file uid
+     * if S arg, a uid too large for octal is an error
+     * else, put_number encodes it as a gnu base-256 number
+     */
+    if (strict && st->st_uid > ID_MAX) {
+        report_msg("%s: uid too large", path);
+        return -1;
     }
+    put_number(head->uid, ID_SIZE, st->st_uid);
 
     /* populate gid field octal with the file gid (same process as uid) */
-    if (st->st_gid > ID_MAX) {
-        if (strict) {
-            fprintf(stderr, "%s: gid too large\n", path);
-            return -1;
-        }
-
-        /* encode it as a regular binary number if too large */
-        if (insert_special_int(head.gid, ID_SIZE, st->st_gid)) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        sprintf(head.gid, "%07o", st->st_gid);
+    if (strict && st->st_gid > ID_MAX) {
+        report_msg("%s: gid too large", path);
+        return -1;
     }
+    put_number(head->gid, ID_SIZE, st->st_gid);
     
     /* is file regular? */
     if (S_ISREG(st->st_mode)) {
         /* set type flag to '0' */
-        head.typeflag[0] = (char)RFLAG;
-        if (st->st_size > SIZE_MAX_) {
-            /* if S arg, return an error 
-             * else, just use gnu tar special int
-             */
-            if (strict) {
-                fprintf(stderr, "%s: size to large\n", path);
-                return -1;
-            }
-            insert_special_int(head.size, SIZE_SIZE, st->st_size);
-        } else {
-            sprintf(head.size, "%011o", (int)st->st_size);
+        head->typeflag[0] = (char)RFLAG;
+        if (strict && st->st_size > SIZE_MAX_) {
+            report_msg("%s: size to large", path);
+            return -1;
+        }
+        /* past 8 GiB this is a gnu base-256 number */
+        put_number(head->size, SIZE_SIZE, st->st_size);
+        /* a link to a file already in the archive has no data */
+        if (linkname != NULL && linkname[0]) {
+            head->typeflag[0] = (char)HFLAG;
         }
     /* is file symlink? */
     } else if (S_ISLNK(st->st_mode)) {
         /* set type flag to '2' */
-        head.typeflag[0] = (char)LFLAG;
+        head->typeflag[0] = (char)LFLAG;
         /* size is zero per specification */
-        sprintf(head.size, "%011o", 0);
-        /* put the value of the link into linkname field */
-        readlink(path, head.linkname, 100);
+        put_number(head->size, SIZE_SIZE, 0);
     /* is file a directory? */
     } else if (S_ISDIR(st->st_mode)) {
         /* set type flag to '5' */
-        head.typeflag[0] = (char)DFLAG;
+        head->typeflag[0] = (char)DFLAG;
         /* size is zero per specification */
-        sprintf(head.size, "%011o", 0);
+        put_number(head->size, SIZE_SIZE, 0);
     }
     
-    /* populate mtime field with files mtime */
-    if (st->st_mtime > MTIME_MAX) {
-        if (strict) {
-            fprintf(stderr, "%s: mtime too large\n", path);
+    /* links keep their target in linkname, an extended header has it
+     * if it's too long (S arg can't have one, so it's an error) */
+    if (linkname != NULL && linkname[0]) {
+        if (strict && strlen(linkname) > LINK_MAX) {
+            report_msg("%s: link target too long", path);
             return -1;
         }
-        insert_special_int(head.mtime, MTIME_SIZE, st->st_mtime);
-    } else {
-        sprintf(head.mtime, "%011o", (int)st->st_mtime);
+        strncpy(head->linkname, linkname, LINK_MAX);
+    }
+    
+    /* populate mtime field with files mtime */
+    if (strict && (st->st_mtime > MTIME_MAX || st->st_mtime < 0)) {
+        report_msg("%s: mtime too large", path);
+        return -1;
     }
+    /* past 2242 or before 1970 this is a gnu base-256 number */
+    put_number(head->mtime, MTIME_SIZE, st->st_mtime);
     
     /* magic and version fields always the same */
-    strcpy(head.magic, "ustar");
-    strcpy(head.version, "00");
+    strcpy(head->magic, "ustar");
+    strcpy(head->version, "00");
     
     /* AND mode with mask to clear everything but the perms */
-    sprintf(head.mode, "%07o", st->st_mode & MODE_MASK);
+    put_number(head->mode, sizeof(head->mode), st->st_mode & MODE_MASK);
     
-    /* retrieve the group name with file gid */
-    if (!(gr = getgrgid(st->st_gid))) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    /* names are left out with --numeric-owner or if the id has none */
+    if (!opts->numeric_owner) {
+        strcpy(head->gname, lookup_name(&ctx->groups, st->st_gid, 1));
+        strcpy(head->uname, lookup_name(&ctx->users, st->st_uid, 0));
     }
     
-    /* truncate name if necessary to fit within field */
-    if (strlen(gr->gr_name) >= UGNAME_MAX) {
-        strncpy(head.gname, gr->gr_name, UGNAME_MAX - 1);
-    } else {
-        strcpy(head.gname, gr->gr_name);
+    return 0;
+}
+
+/*
+ * fill in the chksum of a built header and write it to the archive
+ */
+void put_header(struct archive_out *out, struct tarheader *head) {
+    /* calculate checksum from the header created and populate the field */
+    put_number(head->chksum, sizeof(head->chksum),
+                calculate_checksum((unsigned char *)head));
+    
+    /* write the header to the outfile */
+    out_write(out, head, BLOCK);
+}
+
+/*
+ * write an extended header of type (XHDFLAG or XGLFLAG) with the records
+ * in pax for the member at path
+ * st is the member's stat, used for the owner and mtime of the header
+ * returns -1 if the header can't be named
+ */
+int write_pax(struct create_ctx *ctx, char *path, struct stat *st,
+                                struct pax_out *pax, char type) {
+    struct archive_out *out = ctx->out;
+    struct tarheader head;
+    struct stat xst;
+    char name[PATH_MAX_ + 1];
+
+    pax_name(name, sizeof(name), path, "PaxHeaders");
+
+    xst = *st;
+    xst.st_mode = S_IFREG | 0644;
+    xst.st_size = pax->len;
+    if (build_header(ctx, &head, name, &xst, NULL) == -1) {
+        return -1;
     }
+    head.typeflag[0] = type;
+    put_header(out, &head);
+
+    out_write(out, pax->buf, pax->len);
+    out_zeros(out, BLOCK_ROUND(pax->len) - pax->len);
+    return 0;
+}
+
+/*
+ * anything the header for path can't hold goes in an extended header
+ * before it, which then carries the exact mtime too
+ * (--posix always writes one, strict mode never does)
+ * with --align, a file of a block or more gets one padded out so that
+ * its data starts at an ALIGN_SIZE offset in the archive
+ */
+int write_extended(struct create_ctx *ctx, char *path, struct stat *st,
+                                char *linkname) {
+    struct pax_out *pax = &ctx->pax;
+    off_t pos = ctx->out->pos;
+    size_t blocks;
+    int align;
 
-    /* retrieve user name with the files uid */
-    if (!(pw = getpwuid(st->st_uid))) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    if (ctx->opts->strict) {
+        return 0;
     }
 
-    /* truncate name if necessary to fit within field */
-    if (strlen(pw->pw_name) >= UGNAME_MAX) {
-        strncpy(head.uname, pw->pw_name, UGNAME_MAX - 1);
-    } else {
-        strcpy(head.uname, pw->pw_name);
+    /* lining up the compressed stream would do nothing for extract */
+    align = ctx->opts->align && ctx->opts->compress == COMP_NONE &&
+                S_ISREG(st->st_mode) && st->st_size >= ALIGN_SIZE;
+
+    pax->len = 0;
+    if (split_path(path) == -1) {
+        pax_add(pax, "path", path);
     }
-    
-    /* calculate checksum from the header created and populate the field */
-    sprintf(head.chksum, "%07o", calculate_checksum((unsigned char *)&head));
-    
-    /* write the header to the outfile */
-    if (write(tarfile, &head, BLOCK) == -1) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    if (linkname != NULL && strlen(linkname) > LINK_MAX) {
+        pax_add(pax, "linkpath", linkname);
+    }
+    if (pax->len == 0 && !ctx->opts->posix &&
+            (!align || (pos + BLOCK) % ALIGN_SIZE == 0)) {
+        return 0;
+    }
+    pax_add_time(pax, "mtime", &st->st_mtim);
+
+    /* the data comes after this header, its records and the member's
+     * own header, so pad the records out to put that on the boundary */
+    if (align) {
+        blocks = (pax->len + PAX_PAD_MIN + BLOCK - 1) / BLOCK;
+        while ((pos + (blocks + 2) * BLOCK) % ALIGN_SIZE != 0) {
+            blocks++;
+        }
+        pax_add_pad(pax, blocks * BLOCK - pax->len);
+    }
+    return write_pax(ctx, path, st, pax, XHDFLAG);
+}
+
+/*
+ * build the header for a path and write it to the archive
+ */
+int write_header(struct create_ctx *ctx, char *path, struct stat *st,
+                                char *linkname) {
+    struct tarheader head;
+    off_t start = ctx->out->pos;
+
+    /* if v arg, list out the files as they are added */
+    if (ctx->opts->verbose) {
+        printf("%s\n", path);
     }
 
+    if (build_header(ctx, &head, path, st, linkname) == -1 ||
+            write_extended(ctx, path, st, linkname) == -1) {
+        return -1;
+    }
+    put_header(ctx->out, &head);
+    if (ctx->index != NULL) {
+        index_record(ctx->index, start, head.typeflag[0], path);
+    }
     return 0;
 }
 
 /*
- * write archive blocks to the tarfile with the paths passed in
- *
+ * record the paths deleted since the last incremental, extract removes
+ * them
+ * they all go in one global header at the end rather than in members,
+ * so other tars skip them instead of extracting empty files
+ * (some tars choke on a global header right after another)
  */
-void write_tar(int tarfile, char *path, int verbose, int strict) {
+void write_deleted(struct create_ctx *ctx, char **paths, int n) {
     struct stat st;
-    int infile;
-    char buf[BLOCK];
+    off_t start = ctx->out->pos;
     int i;
-    DIR *dir;
-    struct dirent *dirp;
-    char *path_new;
-    char temp[LINK_MAX];
-
-    /* to be used when writing the header */
-    if (lstat(path, &st) == -1) {
-        perror(path);
+
+    if (n == 0) {
         return;
     }
-    
-    /* is file regular?
-     * then write the header and its data in blocks
-     */
-    if (S_ISREG(st.st_mode)) {
-        /* skip writing file if we can't open for reading */
-        if ((infile = open(path, O_RDONLY)) == -1) {
-            perror(path);
-            return;
+
+    /* owned by whoever is making the archive */
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
+    st.st_uid = getuid();
+    st.st_gid = getgid();
+    st.st_mtime = time(NULL);
+
+    ctx->pax.len = 0;
+    for (i = 0; i < n; i++) {
+        if (ctx->opts->verbose) {
+            printf("%s\n", paths[i]);
+        }
+        pax_add(&ctx->pax, PAX_DELETED, paths[i]);
+    }
+    if (write_pax(ctx, "deleted", &st, &ctx->pax, XGLFLAG) == -1) {
+        return;
+    }
+    if (ctx->index != NULL) {
+        for (i = 0; i < n; i++) {
+            index_record(ctx->index, start, DELFLAG, paths[i]);
+        }
+    }
+}
+
+/*
+ * if the file in m was already archived under another name,
+ * write a hard link to that name instead of the data again
+ * returns -1 if m has to be archived in full
+ */
+int write_hardlink(struct create_ctx *ctx, struct member *m) {
+    struct stat st;
+    char *target;
+
+    if ((target = find_link(&ctx->links, &m->st)) == NULL) {
+        return -1;
+    }
+
+    /* hard links have no data of their own */
+    st = m->st;
+    st.st_size = 0;
+    if (write_header(ctx, m->path, &st, target) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * write a sparse file in the GNU 1.0 pax format
+ * an extended header with the real name and size, then a member holding
+ * the map of data regions (in decimal, padded to a block) followed by
+ * just the data in those regions
+ * returns -1 if nothing was written, so it can go in as a plain file
+ */
+int write_sparse(struct create_ctx *ctx, struct member *m) {
+    struct archive_out *out = ctx->out;
+    struct pax_out *pax = &ctx->pax;
+    struct tarheader head;
+    struct stat st;
+    char name[PATH_MAX_ + 1];
+    char num[24];
+    off_t datalen = 0, got, start = out->pos;
+    size_t maplen;
+    int i;
+
+    /* the map goes first, in the extended header buffer for now */
+    pax->len = 0;
+    pax_add_num(pax, "GNU.sparse.major", 1);
+    pax_add_num(pax, "GNU.sparse.minor", 0);
+    pax_add(pax, "GNU.sparse.name", m->path);
+    pax_add_num(pax, "GNU.sparse.realsize", m->st.st_size);
+    pax_add_time(pax, "mtime", &m->st.st_mtim);
+
+    /* the map is a count then offset/size pairs, a number per line */
+    maplen = sprintf(num, "%d\n", m->nmap);
+    for (i = 0; i < m->nmap; i++) {
+        maplen += sprintf(num, "%lld\n", (long long)m->map[2 * i]);
+        maplen += sprintf(num, "%lld\n", (long long)m->map[2 * i + 1]);
+        datalen += m->map[2 * i + 1];
+    }
+
+    /* the member itself has a stand-in name and the stored size */
+    pax_name(name, sizeof(name), m->path, "GNUSparseFile.0");
+    st = m->st;
+    st.st_size = BLOCK_ROUND(maplen) + datalen;
+    if (build_header(ctx, &head, name, &st, NULL) == -1) {
+        return -1;
+    }
+
+    if (ctx->opts->verbose) {
+        printf("%s\n", m->path);
+    }
+    if (write_pax(ctx, m->path, &m->st, pax, XHDFLAG) == -1) {
+        return -1;
+    }
+    put_header(out, &head);
+    if (ctx->index != NULL) {
+        index_record(ctx->index, start, head.typeflag[0], m->path);
+    }
+
+    /* the map */
+    out_write(out, num, sprintf(num, "%d\n", m->nmap));
+    for (i = 0; i < m->nmap; i++) {
+        out_write(out, num, sprintf(num, "%lld\n", (long long)m->map[2 * i]));
+        out_write(out, num,
+                    sprintf(num, "%lld\n", (long long)m->map[2 * i + 1]));
+    }
+    out_zeros(out, BLOCK_ROUND(maplen) - maplen);
+
+    /* the data regions back to back, the holes are left out */
+    for (i = 0; i < m->nmap; i++) {
+        got = 0;
+        if (lseek(m->fd, m->map[2 * i], SEEK_SET) != -1) {
+            got = out_copy(out, m->fd, m->map[2 * i + 1]);
+        } else {
+            report(m->path);
         }
+        /* keep the archive in step with the map if the file shrank */
+        out_zeros(out, m->map[2 * i + 1] - got);
+    }
+    out_zeros(out, BLOCK_ROUND(datalen) - datalen);
+
+    return 0;
+}
 
-        /* clear the buf so if file doesn't fit perfectly into block
-         * it will still look good
-         */
-        for (i = 0; i < BLOCK; i++) {
-            buf[i] = 0;
+/*
+ * add a data region to the sparse map of a member
+ */
+void add_region(struct member *m, off_t offset, off_t size) {
+    /* grow by powers of two */
+    if ((m->nmap & (m->nmap - 1)) == 0) {
+        if ((m->map = realloc(m->map, 2 * (m->nmap ? 2 * m->nmap : 1) *
+                                sizeof(off_t))) == NULL) {
+            fail("mytar");
         }
+    }
+    m->map[2 * m->nmap] = offset;
+    m->map[2 * m->nmap + 1] = size;
+    m->nmap++;
+}
 
-        if (write_header(tarfile, path, &st, verbose, strict) != -1) {
-            /* read in a block and write it to the tarfile */
-            while (read(infile, buf, BLOCK) > 0 ) {
+/*
+ * returns the target of the symlink at path (in dirfd) in a new string,
+ * size is how long lstat said it is (0 if it doesn't know)
+ * or NULL with errno set if it can't be read
+ */
+char *read_link(int dirfd, char *path, off_t size) {
+    char *target = NULL;
+    size_t cap = size > 0 ? size + 1 : NAME_MAX_;
+    ssize_t n;
 
-                if (write(tarfile, buf, BLOCK) == -1) {
-                    perror("mytar");
-                    exit(EXIT_FAILURE);
-                }
-                
-                /* zero out the buf again */
-                for (i = 0; i < BLOCK; i++) {
-                    buf[i] = 0;
-                }
-            }
+    /* the link could change under us, grow until it fits */
+    for (;;) {
+        if ((target = realloc(target, cap)) == NULL) {
+            fail("mytar");
         }
-        close(infile);
-    /* is file link?
-     * just write the header, all the data is in the linkname
-     */
-    } else if (S_ISLNK(st.st_mode)) {
-        /* skip writing link if we cannot open */
-        if (readlink(path, temp, LINK_MAX) == -1) {
-            perror(path);
-            return;
+        if ((n = readlinkat(dirfd, path, target, cap)) == -1) {
+            free(target);
+            return NULL;
         }
-        write_header(tarfile, path, &st, verbose, strict); 
-    /* is file a dir?
-     * write the header then recurse on all the entries
-     */
-    } else if (S_ISDIR(st.st_mode)) {
-        /* catch path too long */
-        if (strlen(path) > PATH_MAX_) {
-            fprintf(stderr, "%s: path too long\n", path);
-        }
-        
-        /* something to put the new path into */
-        if ((path_new = (char *)malloc(PATH_MAX_)) == NULL) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        }
-        
-        /* skip writing dir to archive if cannot open */
-        if ((dir = opendir(path)) == NULL) {
-            perror(path);
-            return;
+        if (n < cap) {
+            target[n] = '\0';
+            return target;
         }
+        cap *= 2;
+    }
+}
 
-        /* add add slash to match mytar*/
-        strcat(path, "/");
-        write_header(tarfile, path, &st, verbose, strict);
-        
-        
-        /* go through all directory entries and recurse */
-        while ((dirp = readdir(dir)) != NULL) {
-            /* don't recurse on . or .. !!! */
-            if (strcmp(dirp->d_name, ".") != 0 &&
-                    strcmp(dirp->d_name, "..") != 0) {
-                if ((strlen(path) + strlen(dirp->d_name)) < PATH_MAX_) {
-                    strcpy(path_new, path);
-                    strcat(path_new, dirp->d_name);
-                    write_tar(tarfile, path_new, verbose, strict);
-                } else {
-                    fprintf(stderr, "%s: path too long\n", path);
-                }
+/*
+ * map out the data regions of a file with holes in it
+ * leaves nmap at 0 if the file should just be stored as is
+ */
+void find_holes(struct member *m) {
+    off_t size = m->st.st_size;
+    off_t data, hole = 0;
+
+    while (hole < size) {
+        if ((data = lseek(m->fd, hole, SEEK_DATA)) == -1) {
+            /* ENXIO means the rest of the file is a hole */
+            if (errno == ENXIO) {
+                break;
             }
+            /* no way to find holes here */
+            m->nmap = 0;
+            return;
+        }
+        if ((hole = lseek(m->fd, data, SEEK_HOLE)) == -1 || hole > size) {
+            hole = size;
         }
-        closedir(dir);
-        free(path_new);
+        add_region(m, data, hole - data);
     }
+
+    if (m->nmap == 1 && m->map[0] == 0 && m->map[1] == size) {
+        /* one region from start to end isn't sparse */
+        m->nmap = 0;
+    } else if (m->nmap == 0 ||
+            m->map[2 * m->nmap - 2] + m->map[2 * m->nmap - 1] < size) {
+        /* a file ending in a hole gets an empty region to mark its end */
+        add_region(m, size, 0);
+    }
+
+    lseek(m->fd, 0, SEEK_SET);
 }
 
-/* 
- * the create command mode accessed by the main function
+/*
+ * stat, open and read ahead a member so the writer only has to copy it
+ * any failure is saved in err and reported by the writer, in order
  */
-void create(char *filename, char **paths, int npaths, int verbose, int strict) {
-    int tarfile;
-    int i = 0;
-    char *path;
-    
-    /* create the tarfile with the perms rw_r____ as specified */
-    if ((tarfile = open(filename, O_RDWR | O_CREAT | O_TRUNC, 
-                            S_IRUSR | S_IWUSR | S_IRGRP)) == -1) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+void read_member(struct create_ctx *ctx, struct member *m) {
+    int dirfd = m->dir != NULL ? m->dir->fd : AT_FDCWD;
+    size_t want;
+    ssize_t n;
+
+    if (!m->have_stat &&
+            fstatat(dirfd, m->name, &m->st, AT_SYMLINK_NOFOLLOW) == -1) {
+        m->err = errno;
+        return;
     }
-    
-    /* go through all the paths passed in and archive them */
-    while (npaths > 0) {
-        path = paths[i++];
-        /* make sure we don't get a double slash */
-        if (path[strlen(path) - 1] == '/') {
-            path[strlen(path) - 1] = '\0';
-        }
 
-        write_tar(tarfile, path, verbose, strict);
-        npaths--;
-    } 
-    
-    /* finish off the archive with the stop blocks */
-    write_stop_blocks(tarfile);
+    /* no need to read anything the last incremental already has */
+    if (ctx->snap != NULL && !S_ISDIR(m->st.st_mode) &&
+            snapshot_unchanged(ctx->snap, m->path, &m->st)) {
+        m->unchanged = 1;
+        return;
+    }
+
+    if (S_ISREG(m->st.st_mode)) {
+        /* skip writing file if we can't open for reading */
+        if ((m->fd = openat(dirfd, m->name, O_RDONLY)) == -1) {
+            m->err = errno;
+            return;
+        }
+
+        /* fewer blocks than bytes means holes; pax can't be strict ustar */
+        if (!ctx->opts->strict &&
+                m->st.st_blocks * BLOCK < m->st.st_size) {
+            find_holes(m);
+            if (m->nmap > 0) {
+                return;
+            }
+        }
+
+        /* only the first name of a hard linked file needs the data,
+         * and only the writer knows which one that is */
+        if (m->st.st_nlink > 1) {
+            return;
+        }
+
+        /* read ahead the start of the file, the writer copies the rest */
+        want = m->st.st_size < PREFETCH_MAX ? m->st.st_size : PREFETCH_MAX;
+        if (want == 0) {
+            return;
+        }
+
+        /* zeroed so a partial last block is already padded */
+        if ((m->data = calloc(BLOCK_ROUND(want), sizeof(char))) == NULL) {
+            fail("mytar");
+        }
+        while (m->datalen < want) {
+            n = read(m->fd, m->data + m->datalen, want - m->datalen);
+            if (n <= 0) {
+                break;
+            }
+            m->datalen += n;
+        }
+
+        /* the whole file is in data, no need to keep it open */
+        if (m->datalen < PREFETCH_MAX) {
+            close(m->fd);
+            m->fd = -1;
+        }
+    } else if (S_ISLNK(m->st.st_mode)) {
+        /* skip writing link if we cannot open */
+        if ((m->linkname = read_link(dirfd, m->name,
+                                        m->st.st_size)) == NULL) {
+            m->err = errno;
+        }
+    }
+}
+
+/*
+ * write a member prepared by read_member to the tarfile
+ */
+void write_member(struct create_ctx *ctx, struct member *m) {
+    struct archive_out *out = ctx->out;
+    char buf[BLOCK];
+    off_t written, body;
+
+    if (m->err) {
+        errno = m->err;
+        report(m->path);
+        /* only a path that is really gone counts as deleted */
+        if (ctx->snap != NULL && m->err != ENOENT) {
+            snapshot_keep(ctx->snap, m->path);
+        }
+        return;
+    }
+
+    /* everything still around goes in the snapshot, changed or not */
+    if (ctx->snap != NULL) {
+        snapshot_record(ctx->snap, m->path, &m->st);
+        if (m->unchanged) {
+            return;
+        }
+    }
+
+    /* a file we already archived under another name is just a link */
+    if (S_ISREG(m->st.st_mode) && m->st.st_nlink > 1) {
+        if (write_hardlink(ctx, m) == 0) {
+            return;
+        }
+    }
+
+    /* sparse files only store their data regions */
+    if (m->nmap > 0 && write_sparse(ctx, m) == 0) {
+        if (m->st.st_nlink > 1) {
+            add_link(&ctx->links, &m->st, m->path);
+        }
+        return;
+    }
+
+    /* is file regular?
+     * then write the header and its data in blocks
+     */
+    if (S_ISREG(m->st.st_mode)) {
+        if (write_header(ctx, m->path, &m->st, NULL) == -1) {
+            return;
+        }
+        if (m->st.st_nlink > 1) {
+            add_link(&ctx->links, &m->st, m->path);
+        }
+
+        /* everything read ahead is already padded to a whole block */
+        written = BLOCK_ROUND(m->datalen);
+        if (written > 0) {
+            out_write(out, m->data, written);
+        }
+
+        /* the file was too big to read ahead, finish it off here */
+        if (m->fd != -1) {
+            /* the kernel moves all the whole blocks */
+            body = m->st.st_size / BLOCK * BLOCK;
+            if (written < body) {
+                written += out_copy(out, m->fd, body - written);
+            }
+
+            /* clear the buf so if file doesn't fit perfectly into block
+             * it will still look good
+             */
+            if (written == body && written < m->st.st_size) {
+                memset(buf, 0, BLOCK);
+                if (read(m->fd, buf, m->st.st_size - written) == -1) {
+                    report(m->path);
+                }
+                out_write(out, buf, BLOCK);
+                written += BLOCK;
+            }
+        }
+
+        /* keep the archive in step with the header if the file shrank */
+        if (written < BLOCK_ROUND(m->st.st_size)) {
+            out_zeros(out, BLOCK_ROUND(m->st.st_size) - written);
+        }
+    /* links and dirs are just a header */
+    } else if (S_ISLNK(m->st.st_mode) || S_ISDIR(m->st.st_mode)) {
+        write_header(ctx, m->path, &m->st, m->linkname);
+    }
+}
+
+/*
+ * let go of a directory, closing it once nothing needs it
+ * the walker and the writer both do this, so the count is atomic
+ */
+void dir_release(struct dir_handle *dir) {
+    if (dir != NULL &&
+            __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+/*
+ * release everything a member holds onto
+ */
+void free_member(struct member *m) {
+    if (m->fd != -1) {
+        close(m->fd);
+    }
+    free(m->data);
+    free(m->map);
+    free(m->linkname);
+    free(m->path);
+    dir_release(m->dir);
+}
+
+/*
+ * hand a member found by the walker off to be archived
+ * dir is the directory it was found in and name is where path
+ * leaves it, or dir is NULL for the paths given
+ * single threaded it is read and written right away,
+ * otherwise it waits in the queue for a reader
+ */
+void submit(struct create_ctx *ctx, char *path, struct stat *st, int err,
+                                struct dir_handle *dir, size_t name) {
+    struct queue *q = ctx->q;
+    struct member m;
+
+    memset(&m, 0, sizeof(m));
+    m.fd = -1;
+    m.err = err;
+    if ((m.path = strdup(path)) == NULL) {
+        fail("mytar");
+    }
+    m.name = m.path + name;
+    if ((m.dir = dir) != NULL) {
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    }
+    if (st != NULL) {
+        m.st = *st;
+        m.have_stat = 1;
+    }
+
+    if (q == NULL) {
+        ctx->cur = m;
+        if (!m.err) {
+            read_member(ctx, &ctx->cur);
+        }
+        write_member(ctx, &ctx->cur);
+        free_member(&ctx->cur);
+        ctx->cur.path = NULL;
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (q->head - q->tail == q->nslots) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    /* nothing left for a reader to do on a failed member */
+    m.ready = (m.err != 0);
+    q->slots[q->head % q->nslots] = m;
+    q->head++;
+    pthread_cond_signal(&q->not_empty);
+    if (m.ready) {
+        pthread_cond_signal(&q->ready);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * where the data of the file d (in dirfd) starts on the disk, from FIEMAP
+ * falls back on the inode if it has no extent to ask about
+ */
+unsigned long long disk_offset(int dirfd, struct dirent64 *d) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    int fd;
+
+    /* nothing to read in the rest, they go after the files */
+    if (d->d_type != DT_REG) {
+        return ULLONG_MAX;
+    }
+    if ((fd = openat(dirfd, d->d_name, O_RDONLY | O_NOFOLLOW)) == -1) {
+        return d->d_ino;
+    }
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == -1 ||
+            fm.map.fm_mapped_extents == 0) {
+        close(fd);
+        return d->d_ino;
+    }
+    close(fd);
+    return fm.map.fm_extents[0].fe_physical;
+}
+
+int compare_entries(const void *a, const void *b) {
+    const struct walk_entry *x = a, *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/*
+ * read all of the directory in f and sort it for --sort
+ * returns -1 if it can't be read
+ */
+int sort_entries(struct walk_frame *f, int sort) {
+    size_t cap = WALK_BUF;
+    int n, room = 0;
+    ssize_t got;
+    struct dirent64 *d;
+
+    /* the whole directory goes in buf, which grows to fit */
+    f->len = 0;
+    for (;;) {
+        if (cap - f->len < WALK_BUF) {
+            cap *= 2;
+            if ((f->buf = realloc(f->buf, cap)) == NULL) {
+                fail("mytar");
+            }
+        }
+        if ((got = getdents64(f->dir->fd, f->buf + f->len,
+                                cap - f->len)) == -1) {
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        f->len += got;
+    }
+
+    for (n = 0, f->pos = 0; f->pos < f->len; f->pos += d->d_reclen) {
+        d = (struct dirent64 *)(f->buf + f->pos);
+        if (n == room) {
+            room = room ? room * 2 : 64;
+            if ((f->ents = realloc(f->ents, room *
+                                sizeof(struct walk_entry))) == NULL) {
+                fail("mytar");
+            }
+        }
+        f->ents[n].d = d;
+        f->ents[n].index = n;
+        f->ents[n].key = sort == SORT_DISK ? disk_offset(f->dir->fd, d) :
+                                                    d->d_ino;
+        n++;
+    }
+    qsort(f->ents, n, sizeof(struct walk_entry), compare_entries);
+
+    /* pos now counts through ents */
+    f->nents = n;
+    f->pos = 0;
+    return 0;
+}
+
+/*
+ * the next entry of the directory in f, in getdents order or sorted
+ * returns NULL at the end, with errno set if it couldn't be read
+ */
+struct dirent64 *next_entry(struct walk_frame *f, int sort) {
+    struct dirent64 *d;
+    ssize_t n;
+
+    errno = 0;
+    if (sort != SORT_NONE) {
+        if (f->ents == NULL && !f->whole && sort_entries(f, sort) == -1) {
+            return NULL;
+        }
+        if (f->pos < f->nents) {
+            return f->ents[f->pos++].d;
+        }
+    } else {
+        /* read the next batch of entries when this one runs out */
+        if (f->pos == f->len && !f->whole) {
+            if ((n = getdents64(f->dir->fd, f->buf, WALK_BUF)) <= 0) {
+                return NULL;
+            }
+            f->pos = 0;
+            f->len = n;
+        }
+        if (f->pos < f->len) {
+            d = (struct dirent64 *)(f->buf + f->pos);
+            f->pos += d->d_reclen;
+            return d;
+        }
+    }
+
+    /* all that was read in whole has been handed out */
+    errno = f->err;
+    return NULL;
+}
+
+/*
+ * read the rest of the directory in f, so it can go on without its fd
+ * an error reading it is kept for when what was read runs out
+ */
+void read_rest(struct walk_frame *f, int sort) {
+    size_t cap = WALK_BUF;
+    ssize_t got;
+
+    if (sort != SORT_NONE) {
+        if (f->ents == NULL && sort_entries(f, sort) == -1) {
+            f->err = errno;
+        }
+        f->whole = 1;
+        return;
+    }
+
+    /* what hasn't been handed out yet goes to the front */
+    memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+    f->len -= f->pos;
+    f->pos = 0;
+    for (;;) {
+        if (cap - f->len < WALK_BUF) {
+            cap *= 2;
+            if ((f->buf = realloc(f->buf, cap)) == NULL) {
+                fail("mytar");
+            }
+        }
+        if ((got = getdents64(f->dir->fd, f->buf + f->len,
+                                cap - f->len)) <= 0) {
+            f->err = got == -1 ? errno : 0;
+            break;
+        }
+        f->len += got;
+    }
+    f->whole = 1;
+}
+
+/*
+ * the walker has as many directories open as it may: let go of the one
+ * highest up, which is the furthest from being needed again
+ */
+void walk_detach(struct walker *w, int sort) {
+    struct walk_frame *f = w->stack;
+
+    while (f->dir == NULL) {
+        f++;
+    }
+    read_rest(f, sort);
+    dir_release(f->dir);
+    f->dir = NULL;
+    w->held--;
+}
+
+/*
+ * should path be left out of the archive (--exclude)?
+ */
+int excluded(struct create_ctx *ctx, char *path) {
+    char *name;
+
+    if (ctx->opts->exclude == NULL) {
+        return 0;
+    }
+    name = strrchr(path, '/');
+    return matcher_match(ctx->opts->exclude, path,
+                                name != NULL ? name + 1 : path);
+}
+
+/*
+ * open the directory name in parent (or the cwd if it's NULL)
+ * returns NULL with errno set if it can't be
+ */
+struct dir_handle *dir_open(struct dir_handle *parent, char *name) {
+    struct dir_handle *dir;
+    int fd;
+
+    if ((fd = openat(parent != NULL ? parent->fd : AT_FDCWD, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+        return NULL;
+    }
+    if ((dir = malloc(sizeof(struct dir_handle))) == NULL) {
+        fail("mytar");
+    }
+    dir->fd = fd;
+    dir->refs = 1;
+    return dir;
+}
+
+/*
+ * walk a path, submitting it and everything below it in readdir order
+ * directories are read with getdents64 and everything in them is
+ * looked at relative to their fd, so no path is resolved twice;
+ * the stack of open directories is explicit, not recursion
+ * with --sort, each directory is read in whole and sorted first
+ */
+void walk(struct create_ctx *ctx, char *root) {
+    struct walker *w = &ctx->walker;
+    struct walk_frame *f;
+    struct dir_handle *dir;
+    struct dirent64 *d;
+    struct stat st;
+    size_t len, need, name;
+    struct rlimit lim;
+
+    /* excluded paths are never looked at, or anything below them */
+    if (excluded(ctx, root)) {
+        return;
+    }
+
+    /* only directories need to be looked at before they are submitted */
+    if (lstat(root, &st) == -1) {
+        submit(ctx, root, NULL, errno, NULL, 0);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        submit(ctx, root, &st, 0, NULL, 0);
+        return;
+    }
+
+    /* leave most of the fds for the files being read */
+    w->maxheld = WALK_FDS_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY &&
+            lim.rlim_cur / 4 < WALK_FDS_MAX) {
+        w->maxheld = lim.rlim_cur / 4 > 1 ? lim.rlim_cur / 4 : 2;
+    }
+
+    /* the path of whatever we are on, grown as needed */
+    len = strlen(root);
+    w->pathcap = len + NAME_MAX + 2;
+    if ((w->path = malloc(w->pathcap)) == NULL) {
+        fail("mytar");
+    }
+
+    /* skip writing dir to archive if cannot open */
+    if ((dir = dir_open(NULL, root)) == NULL) {
+        free(w->path);
+        w->path = NULL;
+        submit(ctx, root, NULL, errno, NULL, 0);
+        return;
+    }
+
+    /* add add slash to match mytar*/
+    strcpy(w->path, root);
+    w->path[len++] = '/';
+    w->path[len] = '\0';
+
+    for (;;) {
+        /* dirs are submitted before what's in them, then walked
+         * (they go on the stack first so nothing loses track of them) */
+        if (dir != NULL) {
+            if (w->depth == w->cap) {
+                w->cap = w->cap ? w->cap * 2 : 16;
+                if ((w->stack = realloc(w->stack,
+                                w->cap * sizeof(*w->stack))) == NULL) {
+                    fail("mytar");
+                }
+            }
+            f = &w->stack[w->depth++];
+            f->dir = dir;
+            f->pos = f->len = 0;
+            f->buf = NULL;
+            f->ents = NULL;
+            f->nents = 0;
+            f->whole = 0;
+            f->err = 0;
+            f->pathlen = len;
+            w->held++;
+            dir = NULL;
+            if ((f->buf = malloc(WALK_BUF)) == NULL) {
+                fail("mytar");
+            }
+            submit(ctx, w->path, &st, 0, NULL, 0);
+        }
+        if (w->depth == 0) {
+            break;
+        }
+        f = &w->stack[w->depth - 1];
+
+        /* go back up when the directory is done */
+        if ((d = next_entry(f, ctx->opts->sort)) == NULL) {
+            /* the writer reports it, and keeps what wasn't read of it
+             * in the snapshot */
+            w->path[f->pathlen] = '\0';
+            if (errno) {
+                submit(ctx, w->path, NULL, errno, NULL, 0);
+            }
+            if (f->dir != NULL) {
+                dir_release(f->dir);
+                w->held--;
+            }
+            free(f->buf);
+            free(f->ents);
+            w->depth--;
+
+            /* back in a directory we let go of, open it again so what's
+             * left of it can be looked at relative to it (or by path, if
+             * it can't be) */
+            if (w->depth > 0 && w->stack[w->depth - 1].dir == NULL) {
+                f = &w->stack[w->depth - 1];
+                w->path[f->pathlen] = '\0';
+                if ((f->dir = dir_open(NULL, w->path)) != NULL) {
+                    w->held++;
+                }
+            }
+            continue;
+        }
+
+        /* don't recurse on . or .. !!! */
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+            continue;
+        }
+
+        need = f->pathlen + strlen(d->d_name) + 2;
+        if (need > w->pathcap) {
+            w->pathcap = need * 2;
+            if ((w->path = realloc(w->path, w->pathcap)) == NULL) {
+                fail("mytar");
+            }
+        }
+        strcpy(w->path + f->pathlen, d->d_name);
+        if (excluded(ctx, w->path)) {
+            continue;
+        }
+
+        /* with no fd on the directory, everything goes by path */
+        name = f->dir != NULL ? f->pathlen : 0;
+
+        /* the type from getdents saves a stat on everything but dirs */
+        if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) {
+            submit(ctx, w->path, NULL, 0, f->dir, name);
+            continue;
+        }
+        if (fstatat(f->dir != NULL ? f->dir->fd : AT_FDCWD, w->path + name,
+                                        &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            submit(ctx, w->path, NULL, errno, NULL, 0);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            submit(ctx, w->path, &st, 0, f->dir, name);
+            continue;
+        }
+        if (w->held >= w->maxheld) {
+            walk_detach(w, ctx->opts->sort);
+        }
+        if ((dir = dir_open(f->dir, w->path + name)) == NULL) {
+            submit(ctx, w->path, NULL, errno, NULL, 0);
+            continue;
+        }
+        len = strlen(w->path);
+        w->path[len++] = '/';
+        w->path[len] = '\0';
+    }
+
+    free(w->stack);
+    free(w->path);
+    memset(w, 0, sizeof(struct walker));
+}
+
+/*
+ * let go of everything the walker has open, after a failure
+ */
+void walk_abort(struct walker *w) {
+    struct walk_frame *f;
+
+    while (w->depth > 0) {
+        f = &w->stack[--w->depth];
+        dir_release(f->dir);
+        free(f->buf);
+        free(f->ents);
+    }
+    free(w->stack);
+    free(w->path);
+    memset(w, 0, sizeof(struct walker));
+}
+
+/*
+ * archive path and everything under it, like the paths given to create
+ */
+void create_path(struct create_ctx *ctx, char *path) {
+    size_t len = strlen(path);
+
+    /* make sure we don't get a double slash */
+    if (len > 0 && path[len - 1] == '/') {
+        path[len - 1] = '\0';
+    }
+    walk(ctx, path);
+}
+
+/*
+ * walk every path passed in, then let the readers know we are done
+ */
+void walk_paths(struct create_ctx *ctx) {
+    int i;
+
+    /* go through all the paths passed in and archive them */
+    for (i = 0; i < ctx->npaths; i++) {
+        create_path(ctx, ctx->paths[i]);
+    }
+
+    if (ctx->q != NULL) {
+        pthread_mutex_lock(&ctx->q->lock);
+        ctx->q->done = 1;
+        pthread_cond_broadcast(&ctx->q->not_empty);
+        pthread_cond_broadcast(&ctx->q->ready);
+        pthread_mutex_unlock(&ctx->q->lock);
+    }
+}
+
+void *walker_thread(void *arg) {
+    walk_paths((struct create_ctx *)arg);
+    return NULL;
+}
+
+/*
+ * reader threads claim members in order and read them ahead
+ */
+void *reader_thread(void *arg) {
+    struct create_ctx *ctx = (struct create_ctx *)arg;
+    struct queue *q = ctx->q;
+    struct member *m;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        /* the writer may have gone past members failed in the walker
+         * before any reader got to them, and their slots been reused */
+        if (q->next < q->tail) {
+            q->next = q->tail;
+        }
+        /* skip over members that failed in the walker */
+        while (q->next < q->head && q->slots[q->next % q->nslots].ready) {
+            q->next++;
+        }
+        if (q->next == q->head) {
+            if (q->done) {
+                break;
+            }
+            pthread_cond_wait(&q->not_empty, &q->lock);
+            continue;
+        }
+        m = &q->slots[q->next++ % q->nslots];
+
+        /* the slot can't be reused until the writer is through with it */
+        pthread_mutex_unlock(&q->lock);
+        read_member(ctx, m);
+        pthread_mutex_lock(&q->lock);
+
+        m->ready = 1;
+        pthread_cond_broadcast(&q->ready);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/*
+ * write members out in the order the walker found them,
+ * so the archive is the same no matter how many readers there are
+ */
+void write_queue(struct create_ctx *ctx) {
+    struct queue *q = ctx->q;
+    struct member *m;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (q->tail == q->head) {
+            if (q->done) {
+                break;
+            }
+            pthread_cond_wait(&q->ready, &q->lock);
+            continue;
+        }
+        m = &q->slots[q->tail % q->nslots];
+        if (!m->ready) {
+            pthread_cond_wait(&q->ready, &q->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        write_member(ctx, m);
+        free_member(m);
+
+        pthread_mutex_lock(&q->lock);
+        q->tail++;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * archive all the paths with a walker thread, opts->jobs reader threads
+ * and this thread writing
+ */
+void create_parallel(struct create_ctx *ctx) {
+    struct queue q;
+    pthread_t walker;
+    pthread_t *readers;
+    int i;
+
+    memset(&q, 0, sizeof(q));
+    q.nslots = ctx->opts->jobs * SLOTS_PER_JOB;
+    if ((q.slots = calloc(q.nslots, sizeof(struct member))) == NULL ||
+            (readers = malloc(ctx->opts->jobs * sizeof(pthread_t))) == NULL) {
+        fail("mytar");
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_full, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    ctx->q = &q;
+
+    for (i = 0; i < ctx->opts->jobs; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, reader_thread, ctx))) {
+            fail("mytar");
+        }
+    }
+    if ((errno = pthread_create(&walker, NULL, walker_thread, ctx))) {
+        fail("mytar");
+    }
+
+    write_queue(ctx);
+
+    pthread_join(walker, NULL);
+    for (i = 0; i < ctx->opts->jobs; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.not_full);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_cond_destroy(&q.ready);
+    free(readers);
+    free(q.slots);
+    ctx->q = NULL;
+}
+
+/*
+ * start writing an archive to fd, which is left open
+ */
+struct create_ctx *create_open(int fd, struct options *opts) {
+    struct create_ctx *ctx;
+    struct archive_out *out;
+
+    /* compression uses every core unless -j says otherwise
+     * (first, so there's no ctx to clean up if it can't be had) */
+    out = out_open(fd, opts->blocking ? opts->blocking : DEFAULT_BLOCKING,
+                        opts->blocking != 0, opts->compress,
+                        opts->jobs ? opts->jobs :
+                        (int)sysconf(_SC_NPROCESSORS_ONLN));
+    if ((ctx = calloc(1, sizeof(struct create_ctx))) == NULL) {
+        fail("mytar");
+    }
+    ctx->fd = fd;
+    ctx->out = out;
+    ctx->opts = opts;
+    return ctx;
+}
+
+/*
+ * archive the regular file open on fd as name, from its start
+ * returns -1 with errno set if fd isn't a regular file
+ */
+int create_fd(struct create_ctx *ctx, char *name, int fd) {
+    struct member *m = &ctx->cur;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((name = strdup(name)) == NULL) {
+        fail("mytar");
+    }
+    memset(m, 0, sizeof(struct member));
+    m->path = name;
+    m->st = st;
+    if ((m->fd = dup(fd)) == -1 || lseek(m->fd, 0, SEEK_SET) == -1) {
+        fail("mytar");
+    }
+    /* it's only ever this name in the archive */
+    m->st.st_nlink = 1;
+    write_member(ctx, m);
+    free_member(m);
+    m->path = NULL;
+    return 0;
+}
+
+/*
+ * archive the len bytes at data as a regular file called name
+ * owned by whoever is making the archive
+ */
+void create_buffer(struct create_ctx *ctx, char *name, const void *data,
+                   size_t len, mode_t mode, time_t mtime) {
+    struct stat st;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | (mode & MODE_MASK);
+    st.st_nlink = 1;
+    st.st_size = len;
+    st.st_uid = getuid();
+    st.st_gid = getgid();
+    st.st_mtim.tv_sec = mtime;
+    if (write_header(ctx, name, &st, NULL) == -1) {
+        return;
+    }
+    out_write(ctx->out, data, len);
+    out_zeros(ctx->out, BLOCK_ROUND(len) - len);
+}
+
+/*
+ * finish off the archive and free ctx, the fd stays open
+ */
+void create_close(struct create_ctx *ctx) {
+    /* finish off the archive with the stop blocks */
+    write_stop_blocks(ctx->out);
+    out_close(ctx->out);
+    ctx->out = NULL;
+    if (ctx->index != NULL) {
+        index_save(ctx->index, ctx->fd);
+    }
+    free(ctx->pax.buf);
+    free_links(&ctx->links);
+    free_names(&ctx->users);
+    free_names(&ctx->groups);
+    free(ctx);
+}
+
+/*
+ * give up on an archive after a failure part way through creating it,
+ * freeing ctx and letting go of any files and directories still open
+ * (the fd stays open), nothing more is written
+ */
+void create_abort(struct create_ctx *ctx) {
+    walk_abort(&ctx->walker);
+    if (ctx->cur.path != NULL) {
+        free_member(&ctx->cur);
+    }
+    if (ctx->out != NULL) {
+        out_free(ctx->out);
+    }
+    free(ctx->pax.buf);
+    free_links(&ctx->links);
+    free_names(&ctx->users);
+    free_names(&ctx->groups);
+    free(ctx);
+}
+
+/* 
+ * the create command mode accessed by the main function
+ */
+void create(char *filename, char **paths, int npaths, struct options *opts) {
+    struct create_ctx *ctx;
+    int tarfile;
+    char **deleted;
+    int ndeleted;
+    
+    /* create the tarfile with the perms rw_r____ as specified */
+    if ((tarfile = open(filename, O_RDWR | O_CREAT | O_TRUNC, 
+                            S_IRUSR | S_IWUSR | S_IRGRP)) == -1) {
+        fail(filename);
+    }
+
+    ctx = create_open(tarfile, opts);
+    ctx->paths = paths;
+    ctx->npaths = npaths;
+    if (opts->snapshot != NULL) {
+        ctx->snap = snapshot_load(opts->snapshot);
+    }
+    /* offsets into a compressed archive wouldn't help anyone */
+    if (opts->index && opts->compress == COMP_NONE) {
+        ctx->index = index_create(filename);
+    }
+
+    if (opts->jobs > 1) {
+        create_parallel(ctx);
+    } else {
+        walk_paths(ctx);
+    }
+
+    /* let extract know what went away since the last incremental */
+    if (ctx->snap != NULL) {
+        deleted = snapshot_deleted(ctx->snap, &ndeleted);
+        write_deleted(ctx, deleted, ndeleted);
+        free(deleted);
+        snapshot_save(ctx->snap);
+    }
+
+    create_close(ctx);
     close(tarfile);
 }
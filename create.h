@@ -1,5 +1,19 @@
 #ifndef _CREATE_H
 #define _CREATE_H
 
-void create(char *filename, char **paths, int npaths, int verbose, int strict);
+#include <sys/types.h>
+#include <time.h>
+
+#include "util.h"
+
+struct create_ctx;
+
+struct create_ctx *create_open(int fd, struct options *opts);
+void create_path(struct create_ctx *ctx, char *path);
+int create_fd(struct create_ctx *ctx, char *name, int fd);
+void create_buffer(struct create_ctx *ctx, char *name, const void *data,
+                   size_t len, mode_t mode, time_t mtime);
+void create_close(struct create_ctx *ctx);
+void create_abort(struct create_ctx *ctx);
+void create(char *filename, char **paths, int npaths, struct options *opts);
 #endif
@@ -14,252 +14,867 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <utime.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
 #include "util.h"
-
-/* used by extract to do utime after extraction is completed */
+#include "codec.h"
+#include "pax.h"
+#include "archive.h"
+#include "match.h"
+#include "index.h"
+
+/* biggest file a worker gets a copy of when the archive can't be read
+ * at an offset (it's compressed or a pipe), the reader writes the rest */
+#define JOB_DATA_MAX (1024 * 1024)
+/* how many files each worker may have waiting for it */
+#define JOBS_PER_WORKER 4
+/* how many directories extract keeps open to create members in */
+#define DIR_FDS_MAX 256
+/* how big each block of deferred directory times is */
+#define DEFER_BLOCK (64 * 1024)
+/* files this big are allocated ahead of their data and written around
+ * their zeros, smaller ones are just copied by the kernel */
+#define HOLES_MIN (1024 * 1024)
+
+
+/* used by extract to set a directory's times after everything has gone
+ * in it, its path follows it in the block */
 struct deferred_utime_operation {
-    char* path;
-    struct utimbuf newTime;
+    struct timespec newTime[2];
+    size_t size;            /* of this and the path, to the next one */
 };
 
-/* Function to create all necessary paths along a given path */
-void check_dirs(char *path) {
-    int i;
-    char *temp_path;
+/* a block of deferred operations, filled in archive order */
+struct defer_block {
+    struct defer_block *next;
+    size_t used;            /* bytes of data taken */
+    size_t size;
+    struct timespec data[1]; /* really size bytes, aligned for the ops */
+};
 
-    /* Define default perms */
-    mode_t perms = S_IRWXU | S_IRWXG | S_IROTH;
+/* where a member goes: name in the directory dirfd, path for messages */
+struct dest {
+    int dirfd;
+    char *name;
+    char *path;
+    struct timespec times[2]; /* the access and modification times */
+};
 
-    errno = 0;
-    /* Allocate memory for a copy of the path */
-    temp_path = (char *)malloc((strlen(path) + 1) * sizeof(char));
-    /* If allocation fails, output an error and exit */
-    if (temp_path == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
-    }
-
-    /* Copy the path to the allocated memory */
-    strcpy(temp_path, path);
-
-    /* Iterate over the copy of the path */
-    for (i = 0; temp_path[i]; i++) {
-        /* If a directory separator is found */
-        if (temp_path[i] == '/') {
-            /* If it's the last character in the path, clean up and return */
-            if (i >= strlen(path) - 1) {
-                free(temp_path);
-                return;
-            }
-            /* Temporarily end the string at the current directory level */
-            temp_path[i] = '\0';
-            /* Try to create the directory; 
-             * it's not an error if it already exists */
-            if (mkdir(temp_path, perms) && errno != EEXIST) {
-                perror(path);
-                exit(EXIT_FAILURE);
-            }
-            /* Restore the directory separator */
-            temp_path[i] = '/';
-        }
-    }
+/* a regular file for a worker to create and fill */
+struct extract_job {
+    char *path;
+    int dirfd;              /* it goes at name in here */
+    char *name;             /* points into path */
+    struct timespec times[2];
+    mode_t perms;
+    off_t offset;           /* where its data is in the archive */
+    off_t size;
+    char *data;             /* the data itself instead, if not NULL */
+};
 
-    free(temp_path);
-}
+/*
+ * the workers of a parallel extract (-j) and the files waiting for them
+ * the reader thread makes directories, links and everything else itself
+ * and hands regular files off here, in archive order
+ */
+struct extract_pool {
+    struct archive_in *in;
+    struct extract_job *jobs;
+    int njobs;              /* slots in jobs */
+    long head;              /* next seq the reader fills */
+    long tail;              /* next seq a worker takes */
+    int pending;            /* handed out and not finished yet */
+    int done;               /* reader has handed out everything */
+    struct match_set inflight; /* paths handed out since the last wait */
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full, not_empty, idle;
+};
 
-/* Function to extract file content from an archive */
-void extract_file_content(int infile, int outfile, size_t file_size) {
-    /* Buffer to hold file content */
-    char *buff;
-    
+/*
+ * the directories extract has made or found so far, so each one is
+ * only made once, and members go in with *at() calls relative to an
+ * fd on their directory (the set's value) instead of by whole path
+ */
+struct dir_cache {
+    struct match_set dirs;  /* paths without the ./ or a slash at the end */
+    int nfds;               /* how many of them are open */
+    struct extract_pool *pool; /* workers that may be using the fds */
+};
+
+/* Function to extract file content from an archive,
+ * streamed through in_copy so memory use doesn't grow with the file */
+void extract_file_content(struct archive_in *in, int outfile,
+                                off_t file_size) {
     /* Compute padding needed for the file content, based on BLOCK */
     size_t padding = file_size % BLOCK;
+    off_t offset, cloned = 0;
 
-    /* Allocate memory for the buffer according to file size */
-    buff = malloc(sizeof(char) * file_size);
-    
-    /* If memory allocation fails, output error and exit */
-    if (buff == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
-    }
-
-    /* Read file content from the archive into the buffer */
-    if (read(infile, buff, file_size) == -1) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    /* Data lined up by --align can share the archive's blocks */
+    if (file_size >= ALIGN_SIZE && (offset = in_offset(in)) != -1 &&
+            (cloned = in_clone_at(in, offset, outfile, file_size)) > 0) {
+        in_skip(in, cloned);
     }
 
-    /* Write the read file content from the buffer to the output file */
-    if (write(outfile, buff, file_size) == -1) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    /* Copy the file content from the archive to the output file,
+     * a big one allocated ahead of its data and leaving holes where it's
+     * all zeros */
+    if (file_size - cloned >= HOLES_MIN) {
+        in_copy_holes(in, -1, outfile, file_size - cloned, cloned);
+    } else {
+        in_copy(in, outfile, file_size - cloned);
     }
 
     /* Skip padding bytes in the input file, to align with the BLOCK */
-    if (lseek(infile, BLOCK - padding, SEEK_CUR) == -1) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+    if (padding) {
+        in_skip(in, BLOCK - padding);
     }
-
-    free(buff);
 }
 
 /* Function to extract a regular file from an archive */
-void extract_reg_file(int tarfile, const struct tarheader* header, char* path) {
+void extract_reg_file(struct archive_in *in, const struct tarheader* header,
+                      struct dest *dest, off_t size) {
     int new_file;
     mode_t perms;
 
     /* Convert file perms from octal string to mode_t */
-    perms = (mode_t)strtol(header->mode, NULL, OCTAL);
+    perms = (mode_t)get_number(header->mode, sizeof(header->mode));
 
     errno = 0;
     /* Open the new file with the given perms,
      * creating it if it doesn't exist and truncating it if it does */
-    new_file = open(path, O_RDWR | O_CREAT | O_TRUNC, perms);
+    new_file = openat(dest->dirfd, dest->name,
+                        O_RDWR | O_CREAT | O_TRUNC, perms);
     if (new_file == -1) {
-        perror(path);
-        exit(EXIT_FAILURE);
+        fail(dest->path);
     }
 
     /* Extract file content from the archive and write to the new file */
-    extract_file_content(tarfile, new_file, strtol(header->size, NULL, OCTAL));
+    extract_file_content(in, new_file, size);
+
+    /* Set its times while it's open, rather than by path at the end */
+    if (futimens(new_file, dest->times)) {
+        fail(dest->path);
+    }
 
     close(new_file);
 }
 
 
-void extract_sym_link(int tarfile, struct tarheader* header, char* path) {
+/* Function to make a member name safe to create from here, in place:
+ * leading slashes, doubled slashes and "." parts are dropped, so the
+ * directory cache sees one spelling of each path and nothing absolute
+ * returns -1 if a ".." part could take it out of here */
+int clean_name(char *name) {
+    char *src = name, *dst = name, *part;
+    size_t len = strlen(name);
+    int trailing = len > 0 && name[len - 1] == '/';
+
+    while (*src) {
+        while (*src == '/') {
+            src++;
+        }
+        for (part = src; *src && *src != '/'; src++)
+            ;
+        len = src - part;
+        if (len == 2 && part[0] == '.' && part[1] == '.') {
+            return -1;
+        }
+        if (len == 0 || (len == 1 && part[0] == '.')) {
+            continue;
+        }
+        if (dst != name) {
+            *dst++ = '/';
+        }
+        memmove(dst, part, len);
+        dst += len;
+    }
+    /* A directory keeps the slash it ends in */
+    if (trailing && dst != name) {
+        *dst++ = '/';
+    }
+    *dst = '\0';
+    return 0;
+}
+
+/* Function to extract a symbolic link, linkpath is the target
+ * from an extended header if the linkname field was too short */
+void extract_sym_link(struct tarheader* header, struct dest *dest,
+                      char* linkpath) {
     /* Buffer to hold the target of the symbolic link */
     char* link;
 
     errno = 0;
     /* Allocate memory for the link buffer */
-    link = calloc(LINK_MAX + 1, sizeof(char));
+    link = calloc((linkpath ? strlen(linkpath) : LINK_MAX) + 1, sizeof(char));
     if (link == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+        fail("mytar");
     }
 
     /* Copy the target of the symbolic link from the header to the buffer */
-    strncpy(link, (char *)&header->linkname, LINK_MAX);
+    if (linkpath) {
+        strcpy(link, linkpath);
+    } else {
+        strncpy(link, (char *)&header->linkname, LINK_MAX);
+    }
 
     errno = 0;
-    /* Create the symbolic link */
-    if (symlink(link, path) && errno != EEXIST) {
-        perror(path);
-        exit(errno);
+    /* Create the symbolic link, replacing one left by an earlier archive */
+    if (symlinkat(link, dest->dirfd, dest->name) && errno == EEXIST) {
+        if (unlinkat(dest->dirfd, dest->name, 0) == 0) {
+            errno = 0;
+            symlinkat(link, dest->dirfd, dest->name);
+        }
+    }
+    if (errno && errno != EEXIST) {
+        fail(dest->path);
+    }
+
+    /* The times are the link's own, not whatever it points to */
+    if (utimensat(dest->dirfd, dest->name, dest->times, AT_SYMLINK_NOFOLLOW)) {
+        fail(dest->path);
     }
 
     free(link);
 }
 
 
+/* Function to extract a hard link to a file extracted earlier */
+void extract_hard_link(const struct tarheader* header, struct dest *dest,
+                       char* linkpath) {
+    char *target;
+
+    target = calloc((linkpath ? strlen(linkpath) : LINK_MAX) + 3,
+                                                        sizeof(char));
+    if (target == NULL) {
+        fail("mytar");
+    }
+
+    /* The target is a name in the archive, so it's relative to here too
+     * and has to stay under here like any other name */
+    strcpy(target, "./");
+    if (linkpath) {
+        strcat(target, linkpath);
+    } else {
+        strncat(target, header->linkname, LINK_MAX);
+    }
+    if (clean_name(target + 2) == -1) {
+        report_msg("%s: link target contains '..', skipped", dest->path);
+        free(target);
+        return;
+    }
+
+    errno = 0;
+    /* Replace whatever an earlier archive left at the path */
+    if (linkat(AT_FDCWD, target, dest->dirfd, dest->name, 0) &&
+            errno == EEXIST) {
+        if (unlinkat(dest->dirfd, dest->name, 0) == 0) {
+            errno = 0;
+            linkat(AT_FDCWD, target, dest->dirfd, dest->name, 0);
+        }
+    }
+    if (errno) {
+        fail(dest->path);
+    }
+
+    /* The target's times are the link's too, the later one wins */
+    if (utimensat(dest->dirfd, dest->name, dest->times, AT_SYMLINK_NOFOLLOW)) {
+        fail(dest->path);
+    }
+
+    free(target);
+}
+
+/* Function to extract a sparse file stored in the GNU 1.0 pax format:
+ * a map of data regions, then only the data, the rest are holes */
+void extract_sparse_file(struct archive_in *in, const struct tarheader* header,
+                         struct dest *dest, long long stored,
+                         long long realsize) {
+    int new_file;
+    mode_t perms;
+    long long *map;
+    long long nregions, i, offset, size, datalen;
+
+    perms = (mode_t)get_number(header->mode, sizeof(header->mode));
+
+    errno = 0;
+    new_file = openat(dest->dirfd, dest->name,
+                        O_RDWR | O_CREAT | O_TRUNC, perms);
+    if (new_file == -1) {
+        fail(dest->path);
+    }
+
+    /* The map takes whole blocks, so when it is read we're at the data */
+    pax_read_map(in, stored, realsize, &map, &nregions, &datalen);
+
+    /* Seek over the holes and copy the data into place */
+    for (i = 0; i < nregions; i++) {
+        offset = map[2 * i];
+        size = map[2 * i + 1];
+        if (lseek(new_file, offset, SEEK_SET) == -1) {
+            fail(dest->path);
+        }
+        in_copy(in, new_file, size);
+    }
+    free(map);
+
+    /* A hole at the end is just the file being longer */
+    if (ftruncate(new_file, realsize) == -1) {
+        fail(dest->path);
+    }
+
+    /* Skip padding bytes in the input file, to align with the BLOCK */
+    in_skip(in, BLOCK_ROUND(datalen) - datalen);
+
+    if (futimens(new_file, dest->times)) {
+        fail(dest->path);
+    }
+
+    close(new_file);
+}
+
+/* Function to remove a path that an incremental archive says was deleted
+ * returns 1 if it was a directory */
+int extract_deleted(struct dest *dest) {
+    int dir = 0;
+
+    errno = 0;
+    /* Directories were deleted after everything in them */
+    if (unlinkat(dest->dirfd, dest->name, 0) &&
+            (errno == EISDIR || errno == EPERM)) {
+        errno = 0;
+        dir = unlinkat(dest->dirfd, dest->name, AT_REMOVEDIR) == 0;
+    }
+    /* Already gone is fine, anything else is only worth a warning */
+    if (errno && errno != ENOENT) {
+        report(dest->path);
+    }
+    return dir;
+}
+
+/* Function for a worker to create a regular file handed off to it */
+void extract_job_run(struct extract_pool *pool, struct extract_job *job) {
+    int new_file;
+    off_t cloned;
+
+    new_file = openat(job->dirfd, job->name, O_RDWR | O_CREAT | O_TRUNC,
+                                                            job->perms);
+    if (new_file == -1) {
+        fail(job->path);
+    }
+    if (job->data != NULL) {
+        write_all(new_file, job->data, job->size);
+    } else {
+        cloned = in_clone_at(pool->in, job->offset, new_file, job->size);
+        if (job->size - cloned >= HOLES_MIN) {
+            in_copy_holes(pool->in, job->offset + cloned, new_file,
+                            job->size - cloned, cloned);
+        } else {
+            in_copy_at(pool->in, job->offset + cloned, new_file,
+                                                job->size - cloned);
+        }
+    }
+    if (futimens(new_file, job->times)) {
+        fail(job->path);
+    }
+    close(new_file);
+}
+
+/* Function run by each worker: take files in order until there are none */
+void *extract_worker(void *arg) {
+    struct extract_pool *pool = (struct extract_pool *)arg;
+    struct extract_job job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        if (pool->tail == pool->head) {
+            if (pool->done) {
+                break;
+            }
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+            continue;
+        }
+        job = pool->jobs[pool->tail++ % pool->njobs];
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        extract_job_run(pool, &job);
+        free(job.path);
+        free(job.data);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Function to start nthreads workers on the archive in */
+struct extract_pool *pool_start(struct archive_in *in, int nthreads) {
+    struct extract_pool *pool;
+    int i;
+
+    if ((pool = calloc(1, sizeof(struct extract_pool))) == NULL ||
+            (pool->threads = malloc(nthreads * sizeof(pthread_t))) == NULL ||
+            (pool->jobs = malloc(nthreads * JOBS_PER_WORKER *
+                                sizeof(struct extract_job))) == NULL) {
+        fail("mytar");
+    }
+    pool->in = in;
+    pool->njobs = nthreads * JOBS_PER_WORKER;
+    pool->nthreads = nthreads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, extract_worker, pool)) {
+            fail("mytar");
+        }
+    }
+    return pool;
+}
+
+/* Function to wait until the workers have finished every file so far,
+ * for members that need those files to be there (or not be in the way) */
+void pool_wait(struct extract_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    set_free(&pool->inflight);
+}
+
+/* Function to hand the regular file at the archive's position off to a
+ * worker, leaving the archive at the next header
+ * returns -1 if the reader has to write this one itself */
+int pool_submit(struct extract_pool *pool, const struct tarheader* header,
+                struct dest *dest, off_t size) {
+    struct extract_job job;
+
+    job.size = size;
+    job.data = NULL;
+    if ((job.offset = in_offset(pool->in)) == -1) {
+        /* no reading at an offset, small files come along in memory */
+        if (size > JOB_DATA_MAX) {
+            return -1;
+        }
+        if ((job.data = malloc(size + 1)) == NULL) {
+            fail("mytar");
+        }
+        if (in_read(pool->in, job.data, size) != size) {
+            fail_msg("error: currupted archive");
+        }
+        in_skip(pool->in, BLOCK_ROUND(size) - size);
+    } else {
+        in_skip(pool->in, BLOCK_ROUND(size));
+    }
+    job.perms = (mode_t)get_number(header->mode, sizeof(header->mode));
+    if ((job.path = strdup(dest->path)) == NULL) {
+        fail("mytar");
+    }
+    job.dirfd = dest->dirfd;
+    job.name = job.path + (dest->name - dest->path);
+    job.times[0] = dest->times[0];
+    job.times[1] = dest->times[1];
+    set_add(&pool->inflight, job.path, strlen(job.path));
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head - pool->tail == pool->njobs) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    pool->jobs[pool->head++ % pool->njobs] = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* Function to let the workers finish up and wait for them */
+void pool_finish(struct extract_pool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    set_free(&pool->inflight);
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+}
+
+/* Function to close every directory the cache has open,
+ * once no worker can be creating a file in one of them */
+void dirs_close(struct dir_cache *cache) {
+    struct match_str *e;
+    size_t i;
+
+    if (cache->pool != NULL) {
+        pool_wait(cache->pool);
+    }
+    for (i = 0; i < cache->dirs.nbuckets; i++) {
+        for (e = cache->dirs.buckets[i]; e != NULL; e = e->next) {
+            if (e->value != -1) {
+                close(e->value);
+                e->value = -1;
+            }
+        }
+    }
+    cache->nfds = 0;
+}
+
+/* Function to get an fd on a directory in the cache, opening it from
+ * its parent's if it isn't open already (and closing the rest first if
+ * too many are), names in the cache are clean (clean_name)
+ * returns -1 if it can't be opened, whole paths will do then */
+int dir_fd(struct dir_cache *cache, struct match_str *dir) {
+    struct match_str *parent;
+    size_t plen;
+    int parentfd = AT_FDCWD;
+
+    if (dir->value == -1) {
+        /* Checked before the parents open, so none of them are closed */
+        if (cache->nfds >= DIR_FDS_MAX) {
+            dirs_close(cache);
+        }
+        for (plen = dir->len; plen > 0 && dir->str[plen - 1] != '/'; plen--)
+            ;
+        if (plen > 0 && (parent = set_find(&cache->dirs, dir->str,
+                                            plen - 1)) != NULL &&
+                (parentfd = dir_fd(cache, parent)) == -1) {
+            return -1;
+        }
+        dir->value = openat(parentfd, dir->str + plen,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->value != -1) {
+            cache->nfds++;
+        }
+    }
+    return dir->value;
+}
+
+/* Function to make sure the directory at the first len bytes of path
+ * is there, making it with perms and the ones above it if they aren't
+ * returns its place in the cache */
+struct match_str *make_dir(struct dir_cache *cache, char *path, size_t len,
+                           mode_t perms) {
+    struct match_str *dir;
+    size_t plen;
+    int dirfd = AT_FDCWD;
+    char *name;
+
+    if ((dir = set_find(&cache->dirs, path, len)) != NULL) {
+        return dir;
+    }
+
+    /* "a//b" has the same parent as "a/b" */
+    for (plen = len; plen > 0 && path[plen - 1] != '/'; plen--)
+        ;
+    if (plen == len) {
+        return make_dir(cache, path, len - 1, perms);
+    }
+
+    /* The ones above it have the default perms, like before */
+    if (plen > 1) {
+        dirfd = dir_fd(cache, make_dir(cache, path, plen - 1,
+                                        S_IRWXU | S_IRWXG | S_IROTH));
+    }
+    dir = set_add(&cache->dirs, path, len);
+    name = dirfd == -1 ? dir->str : dir->str + plen;
+    if (dirfd == -1) {
+        dirfd = AT_FDCWD;
+    }
+
+    errno = 0;
+    /* Try to create the directory;
+     * it's not an error if it already exists */
+    if (mkdirat(dirfd, name, perms) && errno != EEXIST) {
+        fail(dir->str);
+    }
+    return dir;
+}
+
+/* Function to create all necessary directories along a given path
+ * and find where the member itself goes, path is "./" and a clean name */
+void check_dirs(struct dir_cache *cache, char *path, struct dest *dest) {
+    size_t len = strlen(path), plen;
+    int dirfd;
+
+    dest->dirfd = AT_FDCWD;
+    dest->name = path;
+    dest->path = path;
+
+    /* A directory's own name ends in a slash, its parent is before that */
+    if (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    for (plen = len; plen > 0 && path[plen - 1] != '/'; plen--)
+        ;
+    /* The path starts with "./", which is always there */
+    if (plen > 3) {
+        dirfd = dir_fd(cache, make_dir(cache, path + 2, plen - 3,
+                                        S_IRWXU | S_IRWXG | S_IROTH));
+        if (dirfd != -1) {
+            dest->dirfd = dirfd;
+            dest->name = path + plen;
+        }
+    }
+}
+
 /* Function to extract a directory from an archive */
-void extract_directory(int tarfile,const struct tarheader* header,char* path) {
+void extract_directory(struct dir_cache *cache,
+                       const struct tarheader* header, char* path) {
     /* Variable to store perms for the new directory */
-    mode_t perms = (mode_t)strtol(header->mode, NULL, OCTAL);
+    mode_t perms = (mode_t)get_number(header->mode, sizeof(header->mode));
+    size_t len = strlen(path);
 
-    errno = 0;
-    /* Create the new directory with the given perms */
-    if (mkdir(path, perms) && errno != EEXIST) {
-        perror(path);
-        exit(EXIT_FAILURE);
+    /* Create the new directory with the given perms, unless it's
+     * been made or found already, without the ./ or a slash at the end */
+    while (len > 2 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len > 2) {
+        make_dir(cache, path + 2, len - 2, perms);
+    }
+}
+
+/* Function to add a directory to the list for its times to be set last,
+ * in blocks so there's no realloc or malloc per directory */
+void defer_times(struct defer_block **head, struct defer_block **tail,
+                 char *path, struct timespec *times) {
+    struct deferred_utime_operation *op;
+    struct defer_block *block;
+    size_t need, size;
+
+    /* Keep every op aligned like the first */
+    need = sizeof(struct deferred_utime_operation) + strlen(path) + 1;
+    need = (need + sizeof(struct timespec) - 1) &
+                                        ~(sizeof(struct timespec) - 1);
+
+    if (*tail == NULL || (*tail)->used + need > (*tail)->size) {
+        size = need > DEFER_BLOCK ? need : DEFER_BLOCK;
+        block = malloc(offsetof(struct defer_block, data) + size);
+        if (block == NULL) {
+            fail("mytar");
+        }
+        block->next = NULL;
+        block->used = 0;
+        block->size = size;
+        if (*tail == NULL) {
+            *head = block;
+        } else {
+            (*tail)->next = block;
+        }
+        *tail = block;
+    }
+
+    op = (struct deferred_utime_operation *)((char *)(*tail)->data +
+                                                        (*tail)->used);
+    op->newTime[0] = times[0];
+    op->newTime[1] = times[1];
+    op->size = need;
+    strcpy((char *)(op + 1), path);
+    (*tail)->used += need;
+}
+
+/* Function to set the times of every deferred directory and free them */
+void run_deferred(struct defer_block *head) {
+    struct deferred_utime_operation *op;
+    struct defer_block *next;
+    size_t off;
+
+    for (; head != NULL; head = next) {
+        for (off = 0; off < head->used; off += op->size) {
+            op = (struct deferred_utime_operation *)((char *)head->data + off);
+            if (utimensat(AT_FDCWD, (char *)(op + 1), op->newTime,
+                                                    AT_SYMLINK_NOFOLLOW)) {
+                fail("mytar");
+            }
+        }
+        next = head->next;
+        free(head);
+    }
+}
+
+/* Function to remove the paths a global header says were deleted
+ * since the last incremental, those of them asked for anyway */
+void extract_deletions(struct pax_attrs *attrs, struct selector *sel,
+        struct extract_pool *pool, struct dir_cache *dirs, int verbose) {
+    struct dest dest;
+    char *path;
+    int i;
+
+    /* Nothing should be removed while a worker may be writing it */
+    if (pool != NULL) {
+        pool_wait(pool);
+    }
+    for (i = 0; i < attrs->ndeleted; i++) {
+        if (sel != NULL && !selector_match(sel, attrs->deleted[i], 1)) {
+            continue;
+        }
+        if ((path = malloc(strlen(attrs->deleted[i]) + 3)) == NULL) {
+            fail("mytar");
+        }
+        sprintf(path, "./%s", attrs->deleted[i]);
+        if (clean_name(path + 2) == -1) {
+            report_msg("%s: member name contains '..', skipped", path);
+            free(path);
+            continue;
+        }
+        if (verbose) {
+            printf("%s", path);
+        }
+
+        /* If it was a directory the cache is out of date */
+        dest.dirfd = AT_FDCWD;
+        dest.name = path;
+        dest.path = path;
+        if (extract_deleted(&dest)) {
+            dirs_close(dirs);
+            set_free(&dirs->dirs);
+        }
+        free(path);
     }
 }
 
 /* Function to extract files from a tar archive */
-void extract(char *filename,char **paths,int npaths, int verbose, int strict) {
+void extract(char *filename, char **paths, int npaths, struct options *opts) {
+    int verbose = opts->verbose, strict = opts->strict;
     int tarfile;
+    struct archive_in *in;
     struct tarheader head;
-    int i;
     unsigned long int fileSize;
     unsigned char typeFlag;
     char* path;
     char* pathNoLead;
-    int found;
-    int pathLength;
 
-    /* Variables to hold file stats and new access/modification times */
-    struct stat statBuffer;
-    struct utimbuf newTime;
+    /* The paths given, NULL to extract everything, and where
+     * they are if the archive has an index */
+    struct selector *sel = NULL;
+    struct index_in *idx = NULL;
+    int extended = 0;
 
-    /* List to hold deferred utime operations */
-    struct deferred_utime_operation** deferred_ops = NULL;
-    struct deferred_utime_operation* op;
-    int deferred_ops_count = 0;
+    /* What extended headers said about the next member */
+    struct pax_attrs attrs;
+
+    /* Workers for regular files with -j, NULL if extracting serially */
+    struct extract_pool *pool = NULL;
+
+    /* Directories known to be there, and where this member goes */
+    struct dir_cache dirs;
+    struct dest dest;
+
+    /* Directories to set the times of once everything is in them */
+    struct defer_block *deferred_head = NULL, *deferred_tail = NULL;
 
     /* Open the tar archive */
     tarfile = open(filename, O_RDONLY);
     if (tarfile == -1) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+        fail(filename);
+    }
+    in = in_open(tarfile);
+    pax_init(&attrs);
+    if (opts->jobs > 1) {
+        pool = pool_start(in, opts->jobs);
+    }
+    memset(&dirs, 0, sizeof(dirs));
+    dirs.pool = pool;
+    if (paths) {
+        sel = selector_new(paths, npaths);
+        idx = index_open(filename, in, sel);
     }
 
-
-    /* Read from the tar archive until there's nothing left to read */
-    while ((read(tarfile, &head, BLOCK)) > 0){
-        /* if end of archive is indicated, just return */
-        if (check_currupt_archive(tarfile, &head, strict) == 0) {
-            return;
+    /* Read from the tar archive until there's nothing left to read,
+     * with an index just the members asked for */
+    while ((idx == NULL || extended || index_next(idx, in)) &&
+            in_read(in, &head, BLOCK) > 0) {
+        /* if end of archive is indicated, stop reading */
+        if (check_currupt_archive(in, &head, strict) == 0) {
+            break;
         }
         
         typeFlag = head.typeflag[0];
 
-        /* Convert file size from octal string to unsigned long int */
-        fileSize = strtol(head.size, NULL, OCTAL);
+        /* Extended headers just describe the member after them */
+        if (typeFlag == XHDFLAG || typeFlag == XGLFLAG) {
+            pax_read(in, &head, &attrs);
+            extended = 1;
+
+            /* Or are all that's left of paths deleted since the last
+             * incremental */
+            if (attrs.ndeleted > 0) {
+                extract_deletions(&attrs, sel, pool, &dirs, verbose);
+                pax_clear(&attrs);
+                extended = 0;
+            }
+            continue;
+        }
+        extended = 0;
+
+        /* Convert file size from octal (or base-256) to a number,
+         * unless an extended header gave the size */
+        fileSize = attrs.size >= 0 ? attrs.size :
+                                        get_number(head.size, SIZE_SIZE);
 
         /* Allocate memory for the file path + space for ./ */
-        path = calloc(NAME_MAX_ + PREFIX_MAX + 3, sizeof(char));
+        path = calloc((attrs.path ? strlen(attrs.path) : NAME_MAX_ +
+                                        PREFIX_MAX) + 3, sizeof(char));
         if (path == NULL) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
+            fail("mytar");
         }
 
-        /* Build the file path from the tar header */
+        /* Build the file path from the tar header,
+         * unless an extended header gave the whole thing */
         strcat(path, "./");
-        if (head.prefix[0]) {
-            strncat(path, (char*)&head.prefix, PREFIX_MAX);
-            strcat(path, "/");
+        if (attrs.path) {
+            strcat(path, attrs.path);
+        } else {
+            if (head.prefix[0]) {
+                strncat(path, (char*)&head.prefix, PREFIX_MAX);
+                strcat(path, "/");
+            }
+            strncat(path, (char*)&head.name, NAME_MAX_);
+        }
+
+        /* Nothing may land outside the directory extract runs in:
+         * no absolute names, and nothing that climbs out with ".." */
+        if (clean_name(path + 2) == -1) {
+            report_msg("%s: member name contains '..', skipped", path);
+            in_skip(in, BLOCK_ROUND(fileSize));
+            free(path);
+            pax_clear(&attrs);
+            continue;
         }
-        strncat(path, (char*)&head.name, NAME_MAX_);
 
         /* Remove leading "./" from the path */
         pathNoLead = path + 2;
 
-        /* If paths are specified, 
-         * check if the file is in one of the paths */
-        if (paths) {
-            found = 0;
-            for (i = 0; i < npaths; i++) {
-                pathLength = strlen(paths[i]);
-                if (strncmp(pathNoLead, paths[i], pathLength) == 0) {
-                    found = 1;
-                    break;
-                }
-            }
-            /* If the file is not in the paths, skip to the next header */
-            if (!found) {
-                if (fileSize > 0) {
-                    if (lseek(tarfile, (fileSize / BLOCK + 1) * BLOCK,
-                              SEEK_CUR) == -1) {
-                        perror("mytar");
-                        exit(errno);
-                    }
-                }
-                free(path);
-                continue;
-            }
+        /* If paths are specified, check if the file is one of them
+         * or in one, if not skip to the next header */
+        if (sel != NULL &&
+                !selector_match(sel, pathNoLead, typeFlag != DFLAG)) {
+            in_skip(in, BLOCK_ROUND(fileSize));
+            free(path);
+            pax_clear(&attrs);
+            continue;
         }
 
         /* If verbose mode is on, print the file path */
@@ -267,76 +882,82 @@ void extract(char *filename,char **paths,int npaths, int verbose, int strict) {
             printf("%s", path);
         }
 
+        /* Hard links need their target to be there, and nothing should
+         * replace a file a worker may still be writing, so those wait
+         * for the workers to finish everything before them */
+        if (pool != NULL && (typeFlag == HFLAG ||
+                set_has(&pool->inflight, path, strlen(path)))) {
+            pool_wait(pool);
+        }
+
         /* Ensure that the dirs in the path exist */
-        check_dirs(pathNoLead);
+        check_dirs(&dirs, path, &dest);
+
+        /* Leave the access time alone and set the modification time
+         * to the one from the extended header, or else the tar header */
+        dest.times[0].tv_sec = 0;
+        dest.times[0].tv_nsec = UTIME_OMIT;
+        if (attrs.mtime.tv_nsec >= 0) {
+            dest.times[1] = attrs.mtime;
+        } else {
+            dest.times[1].tv_sec = get_number(head.mtime, MTIME_SIZE);
+            dest.times[1].tv_nsec = 0;
+        }
 
-        /* Extract the file based on its type */
+        /* Extract the file based on its type, everything but a
+         * directory gets its times as it's made */
         switch (typeFlag) {
             case RFLAG_ALT:
             case RFLAG:
-                extract_reg_file(tarfile, &head, path);
+                if (attrs.sparse_major == 1 && attrs.realsize >= 0) {
+                    extract_sparse_file(in, &head, &dest, fileSize,
+                                        attrs.realsize);
+                } else if (pool == NULL ||
+                        pool_submit(pool, &head, &dest, fileSize) == -1) {
+                    extract_reg_file(in, &head, &dest, fileSize);
+                }
                 break; 
             case DFLAG:
-                extract_directory(tarfile, &head, path);
+                /* What goes in it later would change its time, so
+                 * that has to wait until the end */
+                extract_directory(&dirs, &head, path);
+                defer_times(&deferred_head, &deferred_tail, path, dest.times);
                 break;
             case LFLAG:
-                extract_sym_link(tarfile, &head, path);
+                extract_sym_link(&head, &dest, attrs.linkpath);
+                break;
+            case HFLAG:
+                extract_hard_link(&head, &dest, attrs.linkpath);
                 break;
 
             default:
-                fprintf(stderr, "mytar: invalid typeflag - '%c'", typeFlag);
-                exit(EXIT_FAILURE);
-        }
-
-        /* Get file info */
-        if (lstat(path, &statBuffer)) {
-            perror("path");
-            exit(errno);
-        }
-
-        /* Set new access time to the old one and
-         * new modification time to the one from the tar header */
-        newTime.actime = statBuffer.st_atime;
-        newTime.modtime = strtol(head.mtime, NULL, OCTAL);
-
-        /* Instead of calling utime() immediately after extraction, 
-         * add a new deferred operation to the list. */
-        op = malloc(sizeof(struct deferred_utime_operation));
-        if (op == NULL) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        }
-        op->path = strdup(path);
-        if (op->path == NULL) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
+                fail_msg("mytar: invalid typeflag - '%c'", typeFlag);
         }
-        op->newTime = newTime;
-
-        deferred_ops = realloc(deferred_ops, (deferred_ops_count + 1) *
-                                                        sizeof(*deferred_ops));
-        if (deferred_ops == NULL) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        }
-        deferred_ops[deferred_ops_count] = op;
-        deferred_ops_count++;
 
         /* Free up the memory used by the file path */
         free(path);
-    }
+        pax_clear(&attrs);
 
-    /* Now that all files and symbolic links have been created, 
-     * perform the deferred utime operations */
-    for (i = 0; i < deferred_ops_count; i++) {
-        if (utime(deferred_ops[i]->path, &(deferred_ops[i]->newTime))) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
+        /* With --occurrence, stop once everything asked for is out */
+        if (sel != NULL && opts->occurrence && selector_done(sel)) {
+            break;
         }
-        free(deferred_ops[i]->path);
-        free(deferred_ops[i]);
     }
-    free(deferred_ops);
+    index_close(idx);
+    selector_free(sel);
+
+    /* Workers have to be done with their files before we touch them */
+    if (pool != NULL) {
+        pool_finish(pool);
+    }
+    dirs.pool = NULL;
+    dirs_close(&dirs);
+    set_free(&dirs.dirs);
+
+    /* Now that everything has been created,
+     * set the times of the directories */
+    run_deferred(deferred_head);
 
+    in_close(in);
     close(tarfile);
 }
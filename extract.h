@@ -1,5 +1,7 @@
 #ifndef _EXTRACT_H
 #define _EXTRACT_H
 
-void extract(char *filename, char **paths, int npaths, int verbose, int strict);
+#include "util.h"
+
+void extract(char *filename, char **paths, int npaths, struct options *opts);
 #endif
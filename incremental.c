@@ -0,0 +1,313 @@
+/*
+ * file: incremental.c
+ *
+ * snapshot files for incremental archives (-g)
+ *
+ * the snapshot lists every path put in the archive along with its
+ * device, inode, size, mtime and ctime. The next create with the same
+ * snapshot only archives paths that are new or changed since then, and
+ * records the ones that have gone away so extract can remove them.
+ *
+ * each record is "dev ino size mtime.nsec ctime.nsec path" ended by a
+ * NUL, so paths can hold any character
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "incremental.h"
+
+#define SNAPSHOT_MAGIC "mytar-snapshot-1\n"
+
+/*
+ * FNV-1a hash of a path
+ */
+size_t hash_path(char *path) {
+    size_t h = 2166136261u;
+
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * find the entry for a path from the last run, NULL if there isn't one
+ */
+struct snap_entry *find_entry(struct snapshot *snap, char *path) {
+    struct snap_entry *e;
+
+    for (e = snap->buckets[hash_path(path) & (snap->nbuckets - 1)];
+                        e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * parse one record at p, returns the start of the next record
+ * or NULL if the record is damaged
+ */
+char *parse_record(char *p, char *end, struct snap_entry *e) {
+    char *path;
+
+    e->dev = strtoull(p, &p, 10);
+    e->ino = strtoull(p, &p, 10);
+    e->size = strtoll(p, &p, 10);
+    e->mtime.tv_sec = strtoll(p, &p, 10);
+    if (*p++ != '.') {
+        return NULL;
+    }
+    e->mtime.tv_nsec = strtol(p, &p, 10);
+    e->ctime.tv_sec = strtoll(p, &p, 10);
+    if (*p++ != '.') {
+        return NULL;
+    }
+    e->ctime.tv_nsec = strtol(p, &p, 10);
+    if (*p++ != ' ') {
+        return NULL;
+    }
+
+    path = p;
+    while (p < end && *p) {
+        p++;
+    }
+    if (p == end || p == path) {
+        return NULL;
+    }
+    e->path = path;
+    return p + 1;
+}
+
+/*
+ * read the snapshot from the last run (if there was one) and start
+ * the new one next to it
+ */
+struct snapshot *snapshot_load(char *filename) {
+    struct snapshot *snap;
+    struct snap_entry *e, **entries = NULL;
+    struct stat st;
+    FILE *file;
+    char *p, *end;
+    size_t i, nalloc = 0, n;
+
+    if ((snap = calloc(1, sizeof(struct snapshot))) == NULL ||
+            (snap->tmpname = malloc(strlen(filename) + 5)) == NULL) {
+        fail("mytar");
+    }
+    snap->filename = filename;
+    sprintf(snap->tmpname, "%s.tmp", filename);
+
+    /* slurp the whole old snapshot, records point into it */
+    if ((file = fopen(filename, "r")) != NULL) {
+        if (fstat(fileno(file), &st) == -1 ||
+                (snap->records = malloc(st.st_size + 1)) == NULL) {
+            fail(filename);
+        }
+        n = fread(snap->records, 1, st.st_size, file);
+        snap->records[n] = '\0';
+        fclose(file);
+
+        if (strncmp(snap->records, SNAPSHOT_MAGIC,
+                    strlen(SNAPSHOT_MAGIC)) != 0) {
+            fail_msg("%s: not a mytar snapshot", filename);
+        }
+        p = snap->records + strlen(SNAPSHOT_MAGIC);
+        end = snap->records + n;
+        while (p < end) {
+            if (snap->count == nalloc) {
+                nalloc = nalloc ? nalloc * 2 : 1024;
+                entries = realloc(entries, nalloc * sizeof(*entries));
+                if (entries == NULL) {
+                    fail("mytar");
+                }
+            }
+            if ((e = calloc(1, sizeof(struct snap_entry))) == NULL) {
+                fail("mytar");
+            }
+            if ((p = parse_record(p, end, e)) == NULL) {
+                fail_msg("%s: currupted snapshot", filename);
+            }
+            entries[snap->count++] = e;
+        }
+    } else if (errno != ENOENT) {
+        fail(filename);
+    }
+
+    /* power of two buckets, about one entry each */
+    for (snap->nbuckets = 16; snap->nbuckets < snap->count;
+                        snap->nbuckets <<= 1)
+        ;
+    if ((snap->buckets = calloc(snap->nbuckets, sizeof(*snap->buckets)))
+                    == NULL) {
+        fail("mytar");
+    }
+    for (i = 0; i < snap->count; i++) {
+        e = entries[i];
+        n = hash_path(e->path) & (snap->nbuckets - 1);
+        e->next = snap->buckets[n];
+        snap->buckets[n] = e;
+    }
+    free(entries);
+
+    if ((snap->newfile = fopen(snap->tmpname, "w")) == NULL) {
+        fail(snap->tmpname);
+    }
+    fputs(SNAPSHOT_MAGIC, snap->newfile);
+
+    return snap;
+}
+
+/*
+ * true if path is the same file, untouched, since the last run
+ * only reads the old snapshot, so reader threads can call it
+ */
+int snapshot_unchanged(struct snapshot *snap, char *path, struct stat *st) {
+    struct snap_entry *e;
+
+    if ((e = find_entry(snap, path)) == NULL) {
+        return 0;
+    }
+    return e->dev == (unsigned long long)st->st_dev &&
+           e->ino == (unsigned long long)st->st_ino &&
+           e->size == (long long)st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           e->ctime.tv_sec == st->st_ctim.tv_sec &&
+           e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*
+ * add a record to the new snapshot
+ */
+void put_record(struct snapshot *snap, struct snap_entry *e) {
+    fprintf(snap->newfile, "%llu %llu %lld %lld.%09ld %lld.%09ld %s",
+            e->dev, e->ino, e->size,
+            (long long)e->mtime.tv_sec, e->mtime.tv_nsec,
+            (long long)e->ctime.tv_sec, e->ctime.tv_nsec, e->path);
+    fputc('\0', snap->newfile);
+}
+
+/*
+ * note that path is still around and add it to the new snapshot
+ * called by the writer only
+ */
+void snapshot_record(struct snapshot *snap, char *path, struct stat *st) {
+    struct snap_entry *e, rec;
+
+    if ((e = find_entry(snap, path)) != NULL) {
+        e->seen = 1;
+    }
+    rec.path = path;
+    rec.dev = st->st_dev;
+    rec.ino = st->st_ino;
+    rec.size = st->st_size;
+    rec.mtime = st->st_mtim;
+    rec.ctime = st->st_ctim;
+    put_record(snap, &rec);
+}
+
+/*
+ * path is still around but couldn't be read this time, so keep what the
+ * last run had for it rather than calling it deleted
+ * if it was a directory, everything under it from the last run is kept
+ * too, since none of that could be looked at either
+ * called by the writer only
+ */
+void snapshot_keep(struct snapshot *snap, char *path) {
+    struct snap_entry *e;
+    char *dir = NULL;
+    size_t i, len = strlen(path);
+
+    /* directories are recorded with their slash */
+    if ((e = find_entry(snap, path)) == NULL && (len == 0 ||
+                                        path[len - 1] != '/')) {
+        if ((dir = malloc(len + 2)) == NULL) {
+            fail("mytar");
+        }
+        sprintf(dir, "%s/", path);
+        e = find_entry(snap, dir);
+        path = dir;
+        len++;
+    }
+    if (e == NULL) {
+        free(dir);
+        return;
+    }
+    if (!e->seen) {
+        e->seen = 1;
+        put_record(snap, e);
+    }
+
+    /* entries seen already this run are in the new snapshot */
+    if (len > 0 && path[len - 1] == '/') {
+        for (i = 0; i < snap->nbuckets; i++) {
+            for (e = snap->buckets[i]; e != NULL; e = e->next) {
+                if (!e->seen && strncmp(e->path, path, len) == 0) {
+                    e->seen = 1;
+                    put_record(snap, e);
+                }
+            }
+        }
+    }
+    free(dir);
+}
+
+int compare_paths_desc(const void *a, const void *b) {
+    return strcmp(*(char **)b, *(char **)a);
+}
+
+/*
+ * returns the paths from the last run that were not seen this time,
+ * in reverse order so everything in a directory comes before it
+ */
+char **snapshot_deleted(struct snapshot *snap, int *n) {
+    struct snap_entry *e;
+    char **paths;
+    size_t i;
+
+    if ((paths = malloc((snap->count + 1) * sizeof(char *))) == NULL) {
+        fail("mytar");
+    }
+    *n = 0;
+    for (i = 0; i < snap->nbuckets; i++) {
+        for (e = snap->buckets[i]; e != NULL; e = e->next) {
+            if (!e->seen) {
+                paths[(*n)++] = e->path;
+            }
+        }
+    }
+    qsort(paths, *n, sizeof(char *), compare_paths_desc);
+    return paths;
+}
+
+/*
+ * replace the old snapshot with the new one and free everything
+ */
+void snapshot_save(struct snapshot *snap) {
+    struct snap_entry *e, *next;
+    size_t i;
+
+    if (fclose(snap->newfile) == EOF ||
+            rename(snap->tmpname, snap->filename) == -1) {
+        fail(snap->filename);
+    }
+
+    for (i = 0; i < snap->nbuckets; i++) {
+        for (e = snap->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(snap->buckets);
+    free(snap->records);
+    free(snap->tmpname);
+    free(snap);
+}
@@ -0,0 +1,37 @@
+#ifndef _INCREMENTAL_H
+#define _INCREMENTAL_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* what the snapshot remembers about one archived path */
+struct snap_entry {
+    char *path;
+    unsigned long long dev, ino;
+    long long size;
+    struct timespec mtime, ctime;
+    int seen;               /* still there on this run */
+    struct snap_entry *next;
+};
+
+/*
+ * the snapshot file of a -g incremental create
+ * old holds the previous run, the new run is streamed to a temp file
+ */
+struct snapshot {
+    char *filename;
+    char *tmpname;
+    struct snap_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    char *records;          /* the old file, entry paths point into it */
+    FILE *newfile;
+};
+
+struct snapshot *snapshot_load(char *filename);
+int snapshot_unchanged(struct snapshot *snap, char *path, struct stat *st);
+void snapshot_record(struct snapshot *snap, char *path, struct stat *st);
+void snapshot_keep(struct snapshot *snap, char *path);
+char **snapshot_deleted(struct snapshot *snap, int *n);
+void snapshot_save(struct snapshot *snap);
+#endif
@@ -0,0 +1,257 @@
+/*
+ * file: index.c
+ *
+ * member indexes (create --index), so list and extract can go straight
+ * to the members asked for instead of reading every header before them
+ *
+ * the index is ARCHIVE.idx, next to the archive. Each record is
+ * "offset type path" ended by a NUL, where offset is the start of the
+ * member's first header (its extended header, if it has one). After the
+ * last record comes "size mtime.nsec\n" of the finished archive, and if
+ * the archive doesn't match that any more the index isn't used.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "index.h"
+#include "match.h"
+#include "archive.h"
+#include "compress.h"
+
+#define INDEX_MAGIC "mytar-index-1\n"
+
+/*
+ * returns a malloc'd archive name with the index suffix and then suffix
+ */
+char *index_name(char *archive, char *suffix) {
+    char *name;
+
+    if ((name = malloc(strlen(archive) + strlen(suffix) + 5)) == NULL) {
+        fail("mytar");
+    }
+    sprintf(name, "%s.idx%s", archive, suffix);
+    return name;
+}
+
+/*
+ * start the index for an archive being created, in a temp file
+ * until the archive is done
+ */
+struct index_out *index_create(char *archive) {
+    struct index_out *idx;
+
+    if ((idx = calloc(1, sizeof(struct index_out))) == NULL) {
+        fail("mytar");
+    }
+    idx->filename = index_name(archive, "");
+    idx->tmpname = index_name(archive, ".tmp");
+    if ((idx->file = fopen(idx->tmpname, "w")) == NULL) {
+        fail(idx->tmpname);
+    }
+    fputs(INDEX_MAGIC, idx->file);
+    return idx;
+}
+
+/*
+ * add the member whose first header starts at offset in the archive
+ */
+void index_record(struct index_out *idx, off_t offset, char type, char *path) {
+    /* regular files may have a NUL type, which would end the record */
+    fprintf(idx->file, "%lld %c %s", (long long)offset,
+                                type ? type : RFLAG, path);
+    fputc('\0', idx->file);
+}
+
+/*
+ * stamp the index with the finished archive's size and mtime,
+ * put it in place and free it
+ */
+void index_save(struct index_out *idx, int archivefd) {
+    struct stat st;
+
+    if (fstat(archivefd, &st) == -1) {
+        fail("mytar");
+    }
+    fprintf(idx->file, "%lld %lld.%09ld\n", (long long)st.st_size,
+                (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    if (fclose(idx->file) == EOF ||
+            rename(idx->tmpname, idx->filename) == -1) {
+        fail(idx->filename);
+    }
+    free(idx->filename);
+    free(idx->tmpname);
+    free(idx);
+}
+
+/*
+ * check the index in records (len bytes, from the file name) still goes
+ * with the archive, and find where its records are, from *p to *end
+ * returns -1 if it doesn't or it's damaged
+ */
+int index_check(char *name, char *records, size_t len, int archivefd,
+                char **p, char **end) {
+    struct stat st;
+    long long size, sec;
+    long nsec;
+    char *q;
+
+    if (len < strlen(INDEX_MAGIC) ||
+            strncmp(records, INDEX_MAGIC, strlen(INDEX_MAGIC)) != 0) {
+        report_msg("%s: not a mytar index", name);
+        return -1;
+    }
+    *p = records + strlen(INDEX_MAGIC);
+
+    /* the stamp is after the last record */
+    for (*end = records + len; *end > *p && (*end)[-1] != '\0'; (*end)--)
+        ;
+    size = strtoll(*end, &q, 10);
+    sec = strtoll(q, &q, 10);
+    nsec = *q == '.' ? strtol(q + 1, &q, 10) : -1;
+    if (*q != '\n') {
+        report_msg("%s: currupted index", name);
+        return -1;
+    }
+
+    if (fstat(archivefd, &st) == -1) {
+        fail("mytar");
+    }
+    if (size != (long long)st.st_size || sec != st.st_mtim.tv_sec ||
+            nsec != st.st_mtim.tv_nsec) {
+        report_msg("%s: out of date, reading the whole archive", name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * returns the offsets of the records from p to end the selector picks
+ * out, and how many in n, or NULL if a record is damaged
+ */
+off_t *index_select(char *name, char *p, char *end, struct selector *sel,
+                    size_t *n) {
+    off_t *offsets, offset;
+    size_t nalloc = 64;
+    char *path;
+
+    if ((offsets = malloc(nalloc * sizeof(off_t))) == NULL) {
+        fail("mytar");
+    }
+    *n = 0;
+    while (p < end) {
+        offset = strtoll(p, &p, 10);
+        if (p[0] != ' ' || p[1] == '\0' || p[2] != ' ') {
+            report_msg("%s: currupted index", name);
+            free(offsets);
+            return NULL;
+        }
+        path = p + 3;
+        p = path + strlen(path) + 1;
+
+        /* don't mark anything found, that's for when it's read */
+        if (!selector_match(sel, path, 0)) {
+            continue;
+        }
+        /* paths deleted together share their global header */
+        if (*n > 0 && offsets[*n - 1] == offset) {
+            continue;
+        }
+        if (*n == nalloc) {
+            nalloc *= 2;
+            offsets = realloc(offsets, nalloc * sizeof(off_t));
+            if (offsets == NULL) {
+                fail("mytar");
+            }
+        }
+        offsets[(*n)++] = offset;
+    }
+    return offsets;
+}
+
+/*
+ * returns the offsets, in archive order, of the members the selector
+ * picks out according to the archive's index, and how many in n
+ * returns NULL if there's no index or it's out of date or damaged,
+ * then the whole archive has to be read
+ */
+off_t *index_lookup(char *archive, int archivefd, struct selector *sel,
+                    size_t *n) {
+    struct stat st;
+    FILE *file;
+    char *name, *records, *p, *end;
+    off_t *offsets = NULL;
+    size_t len;
+
+    name = index_name(archive, "");
+    if ((file = fopen(name, "r")) == NULL) {
+        if (errno != ENOENT) {
+            report(name);
+        }
+        free(name);
+        return NULL;
+    }
+
+    /* slurp the whole index */
+    if (fstat(fileno(file), &st) == -1 ||
+            (records = malloc(st.st_size + 1)) == NULL) {
+        fail(name);
+    }
+    len = fread(records, 1, st.st_size, file);
+    records[len] = '\0';
+    fclose(file);
+
+    if (index_check(name, records, len, archivefd, &p, &end) == 0) {
+        offsets = index_select(name, p, end, sel, n);
+    }
+    free(records);
+    free(name);
+    return offsets;
+}
+
+/*
+ * look up the members the selector picks out of the archive being read,
+ * NULL if it has no usable index (or is compressed), then list and
+ * extract read every header as usual
+ */
+struct index_in *index_open(char *archive, struct archive_in *in,
+                            struct selector *sel) {
+    struct index_in *idx;
+    off_t *offsets;
+    size_t n;
+
+    if (in->method != COMP_NONE ||
+            (offsets = index_lookup(archive, in->fd, sel, &n)) == NULL) {
+        return NULL;
+    }
+    if ((idx = calloc(1, sizeof(struct index_in))) == NULL) {
+        fail("mytar");
+    }
+    idx->offsets = offsets;
+    idx->n = n;
+    return idx;
+}
+
+/*
+ * move the archive to the next member picked out
+ * returns 0 if there are no more
+ */
+int index_next(struct index_in *idx, struct archive_in *in) {
+    if (idx->next == idx->n) {
+        return 0;
+    }
+    in_seek(in, idx->offsets[idx->next++]);
+    return 1;
+}
+
+void index_close(struct index_in *idx) {
+    if (idx != NULL) {
+        free(idx->offsets);
+        free(idx);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct selector;
+struct archive_in;
+
+/* the index create --index writes next to the archive, as it goes */
+struct index_out {
+    char *filename;
+    char *tmpname;
+    FILE *file;
+};
+
+/* the members an index picked out for list or extract, in archive order */
+struct index_in {
+    off_t *offsets;         /* of each member's first header */
+    size_t n;
+    size_t next;            /* the one to go to next */
+};
+
+struct index_out *index_create(char *archive);
+void index_record(struct index_out *idx, off_t offset, char type, char *path);
+void index_save(struct index_out *idx, int archivefd);
+off_t *index_lookup(char *archive, int archivefd, struct selector *sel,
+                    size_t *n);
+struct index_in *index_open(char *archive, struct archive_in *in,
+                            struct selector *sel);
+int index_next(struct index_in *idx, struct archive_in *in);
+void index_close(struct index_in *idx);
+#endif
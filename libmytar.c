@@ -0,0 +1,484 @@
+/*
+ * file: libmytar.c
+ *
+ * the library interface (libmytar.h): archive readers and writers as
+ * handles over the same code the mytar modes use
+ *
+ * the code underneath reports errors with fail and fail_msg, which exit
+ * in mytar. Each call here sets up an error_trap first, so they jump back
+ * to the call instead and it returns -1 with the message kept in the
+ * handle.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmytar.h"
+#include "util.h"
+#include "codec.h"
+#include "archive.h"
+#include "create.h"
+#include "list.h"
+#include "pax.h"
+
+struct mytar_reader {
+    struct error_trap trap;
+    int failed;
+    int done;               /* reached the end of the archive */
+    struct archive_in *in;
+    struct tarheader head;
+    struct pax_attrs attrs;
+    char name[PATH_MAX_ + 2];
+    char linkname[LINK_MAX + 1];
+    char uname[UGNAME_MAX + 1];
+    char gname[UGNAME_MAX + 1];
+    off_t left;             /* member data in the archive not read yet */
+    off_t pad;              /* and the padding after it */
+    /* a sparse member's data regions, read out with the holes put back */
+    long long *map;
+    long long nregions;
+    long long region;       /* the one reading is in or before */
+    off_t pos;              /* how far into the file reading has got */
+    off_t realsize;
+    int deleted;            /* paths in attrs.deleted handed out so far */
+};
+
+struct mytar_writer {
+    struct error_trap trap;
+    int failed;
+    struct options opts;
+    struct create_ctx *ctx; /* NULL once finished */
+    char *path;             /* copy of the path being added */
+};
+
+/*
+ * start reading the archive on fd from its start, compressed or not
+ * returns NULL only if there's no memory for it, an archive that can't
+ * be read shows up as an error from mytar_next
+ */
+struct mytar_reader *mytar_reader_open(int fd) {
+    struct error_trap *saved = error_trap;
+    struct mytar_reader *r;
+
+    if ((r = calloc(1, sizeof(struct mytar_reader))) == NULL) {
+        return NULL;
+    }
+    pax_init(&r->attrs);
+    if (setjmp(r->trap.env) != 0) {
+        error_trap = saved;
+        r->failed = 1;
+        return r;
+    }
+    error_trap = &r->trap;
+    r->in = in_open(fd);
+    error_trap = saved;
+    return r;
+}
+
+/*
+ * copy a header field of up to size chars (maybe not nul ended) into buf
+ */
+void copy_field(char *buf, const char *field, size_t size) {
+    size_t len = strnlen(field, size);
+
+    memcpy(buf, field, len);
+    buf[len] = '\0';
+}
+
+/*
+ * read a sparse member's map, leaving the archive at its data
+ * stored is the member's size in the archive, a map that doesn't fit
+ * it or the file is an error
+ */
+void read_sparse_map(struct mytar_reader *r, long long stored,
+                     long long realsize) {
+    long long datalen;
+
+    if (stored < 0) {
+        fail_msg("error: currupted archive");
+    }
+    pax_read_map(r->in, stored, realsize, &r->map, &r->nregions, &datalen);
+    r->left = datalen;
+    r->pad = BLOCK_ROUND(datalen) - datalen;
+}
+
+/*
+ * describe the next path the global header in head deleted, as an
+ * entry with no data
+ * returns 1
+ */
+int next_deleted(struct mytar_reader *r, struct mytar_entry *entry) {
+    struct tarheader *head = &r->head;
+
+    memset(entry, 0, sizeof(struct mytar_entry));
+    entry->path = r->attrs.deleted[r->deleted++];
+    entry->linkpath = "";
+    entry->type = DELFLAG;
+    entry->uid = get_number(head->uid, sizeof(head->uid));
+    entry->gid = get_number(head->gid, sizeof(head->gid));
+    copy_field(r->uname, head->uname, sizeof(head->uname));
+    copy_field(r->gname, head->gname, sizeof(head->gname));
+    entry->uname = r->uname;
+    entry->gname = r->gname;
+    entry->mtime.tv_sec = get_number(head->mtime, sizeof(head->mtime));
+    return 1;
+}
+
+/*
+ * move on to the next member and describe it in entry
+ * returns 1, 0 at the end of the archive
+ */
+int reader_next(struct mytar_reader *r, struct mytar_entry *entry) {
+    struct tarheader *head = &r->head;
+    struct pax_attrs *attrs = &r->attrs;
+    ssize_t n;
+
+    /* the rest of what a global header deleted */
+    if (r->deleted < attrs->ndeleted) {
+        return next_deleted(r, entry);
+    }
+
+    /* whatever of the last member wasn't read */
+    in_skip(r->in, r->left + r->pad);
+    r->left = r->pad = 0;
+    pax_clear(attrs);
+    r->deleted = 0;
+    free(r->map);
+    r->map = NULL;
+    r->nregions = r->region = 0;
+
+    for (;;) {
+        if ((n = in_read(r->in, head, BLOCK)) == 0) {
+            return 0;
+        }
+        if (n != BLOCK) {
+            fail_msg("error: currupted archive");
+        }
+        if (check_currupt_archive(r->in, head, 0) == 0) {
+            return 0;
+        }
+        /* extended headers just describe the member after them,
+         * or are all that's left of deleted paths */
+        if (head->typeflag[0] != XHDFLAG && head->typeflag[0] != XGLFLAG) {
+            break;
+        }
+        pax_read(r->in, head, attrs);
+        if (attrs->ndeleted > 0) {
+            return next_deleted(r, entry);
+        }
+    }
+
+    memset(entry, 0, sizeof(struct mytar_entry));
+    entry->path = get_name(head, attrs->path, NULL, r->name);
+    if (attrs->linkpath != NULL) {
+        entry->linkpath = attrs->linkpath;
+    } else {
+        copy_field(r->linkname, head->linkname, sizeof(head->linkname));
+        entry->linkpath = r->linkname;
+    }
+    entry->type = head->typeflag[0] == RFLAG_ALT ? RFLAG : head->typeflag[0];
+    entry->mode = get_number(head->mode, sizeof(head->mode)) & MODE_MASK;
+    entry->uid = get_number(head->uid, sizeof(head->uid));
+    entry->gid = get_number(head->gid, sizeof(head->gid));
+    copy_field(r->uname, head->uname, sizeof(head->uname));
+    copy_field(r->gname, head->gname, sizeof(head->gname));
+    entry->uname = r->uname;
+    entry->gname = r->gname;
+    if (attrs->mtime.tv_nsec >= 0) {
+        entry->mtime = attrs->mtime;
+    } else {
+        entry->mtime.tv_sec = get_number(head->mtime, sizeof(head->mtime));
+    }
+
+    /* sparse files hand out what they really hold, holes and all */
+    if (entry->type == RFLAG && attrs->sparse_major == 1 &&
+            attrs->realsize >= 0) {
+        read_sparse_map(r, attrs->size >= 0 ? attrs->size :
+                            get_number(head->size, SIZE_SIZE), attrs->realsize);
+        r->pos = 0;
+        r->realsize = entry->size = attrs->realsize;
+        return 1;
+    }
+    r->left = entry->size = attrs->size >= 0 ? attrs->size :
+                                get_number(head->size, SIZE_SIZE);
+    if (r->left < 0) {
+        fail_msg("error: currupted archive");
+    }
+    r->pad = BLOCK_ROUND(r->left) - r->left;
+    return 1;
+}
+
+/*
+ * move on to the next member of the archive and describe it in entry
+ * returns 1, 0 at the end of the archive or -1 on an error
+ */
+int mytar_next(struct mytar_reader *r, struct mytar_entry *entry) {
+    struct error_trap *saved = error_trap;
+    int ret;
+
+    if (r->failed) {
+        return -1;
+    }
+    if (r->done) {
+        return 0;
+    }
+    if (setjmp(r->trap.env) != 0) {
+        error_trap = saved;
+        r->failed = 1;
+        return -1;
+    }
+    error_trap = &r->trap;
+    if ((ret = reader_next(r, entry)) == 0) {
+        r->done = 1;
+    }
+    error_trap = saved;
+    return ret;
+}
+
+/*
+ * read up to n bytes of the member's stored data into buf
+ */
+ssize_t read_data(struct mytar_reader *r, void *buf, size_t n) {
+    if ((off_t)n > r->left) {
+        n = r->left;
+    }
+    if (n > 0 && in_read(r->in, buf, n) != (ssize_t)n) {
+        fail_msg("error: currupted archive");
+    }
+    r->left -= n;
+    return n;
+}
+
+/*
+ * read up to n bytes of a sparse member into buf, from a data region
+ * or zeros from the hole before one (or at the end)
+ */
+ssize_t read_sparse(struct mytar_reader *r, void *buf, size_t n) {
+    long long *map;
+    off_t end;
+
+    /* past the region reading was in */
+    while (r->region < r->nregions &&
+            r->pos >= r->map[2 * r->region] + r->map[2 * r->region + 1]) {
+        r->region++;
+    }
+    map = r->map + 2 * r->region;
+
+    if (r->region < r->nregions && r->pos >= map[0]) {
+        if ((off_t)n > map[0] + map[1] - r->pos) {
+            n = map[0] + map[1] - r->pos;
+        }
+        n = read_data(r, buf, n);
+    } else {
+        /* zeros up to the next region, or the end of the file */
+        end = r->region < r->nregions ? map[0] : r->realsize;
+        if ((off_t)n > end - r->pos) {
+            n = end - r->pos;
+        }
+        memset(buf, 0, n);
+    }
+    r->pos += n;
+    return n;
+}
+
+/*
+ * read up to n bytes of the current member's data into buf
+ * returns how many, 0 once it has all been read, or -1 on an error
+ */
+ssize_t mytar_read(struct mytar_reader *r, void *buf, size_t n) {
+    struct error_trap *saved = error_trap;
+    ssize_t got;
+
+    if (r->failed) {
+        return -1;
+    }
+    if (setjmp(r->trap.env) != 0) {
+        error_trap = saved;
+        r->failed = 1;
+        return -1;
+    }
+    error_trap = &r->trap;
+    got = r->map != NULL ? read_sparse(r, buf, n) : read_data(r, buf, n);
+    error_trap = saved;
+    return got;
+}
+
+/*
+ * what went wrong with the last call that returned an error
+ */
+const char *mytar_reader_error(struct mytar_reader *r) {
+    return r->trap.msg;
+}
+
+/*
+ * done reading (the fd stays open)
+ */
+void mytar_reader_close(struct mytar_reader *r) {
+    if (r->in != NULL) {
+        in_close(r->in);
+    }
+    pax_clear(&r->attrs);
+    free(r->map);
+    free(r);
+}
+
+/*
+ * start writing an archive to fd, compressed with MYTAR_GZIP or
+ * MYTAR_ZSTD (the same as COMP_GZIP and COMP_ZSTD) or not at all
+ * returns NULL only if there's no memory for it, anything else shows
+ * up as an error from the first call to add to it
+ */
+struct mytar_writer *mytar_writer_open(int fd, int compress) {
+    struct error_trap *saved = error_trap;
+    struct mytar_writer *w;
+
+    if ((w = calloc(1, sizeof(struct mytar_writer))) == NULL) {
+        return NULL;
+    }
+    /* compressed on the calling thread */
+    w->opts.compress = compress;
+    w->opts.jobs = 1;
+    if (setjmp(w->trap.env) != 0) {
+        error_trap = saved;
+        w->failed = 1;
+        return w;
+    }
+    error_trap = &w->trap;
+    w->ctx = create_open(fd, &w->opts);
+    error_trap = saved;
+    return w;
+}
+
+/*
+ * add path to the archive, and everything under it if it's a directory,
+ * like mytar c does
+ * returns -1 if anything under it had to be left out, the last reason
+ * why is the error, but the archive can still be added to
+ */
+int mytar_add_path(struct mytar_writer *w, const char *path) {
+    struct error_trap *saved = error_trap;
+
+    if (w->failed || w->ctx == NULL) {
+        return -1;
+    }
+    free(w->path);
+    if ((w->path = strdup(path)) == NULL) {
+        snprintf(w->trap.msg, sizeof(w->trap.msg), "%s", strerror(errno));
+        return -1;
+    }
+    w->trap.warnings = 0;
+    if (setjmp(w->trap.env) != 0) {
+        error_trap = saved;
+        w->failed = 1;
+        return -1;
+    }
+    error_trap = &w->trap;
+    create_path(w->ctx, w->path);
+    error_trap = saved;
+    return w->trap.warnings ? -1 : 0;
+}
+
+/*
+ * add the regular file open on fd to the archive as name, read from its
+ * start (its offset is left wherever reading it ended up)
+ */
+int mytar_add_fd(struct mytar_writer *w, const char *name, int fd) {
+    struct error_trap *saved = error_trap;
+    int ret;
+
+    if (w->failed || w->ctx == NULL) {
+        return -1;
+    }
+    free(w->path);
+    if ((w->path = strdup(name)) == NULL) {
+        snprintf(w->trap.msg, sizeof(w->trap.msg), "%s", strerror(errno));
+        return -1;
+    }
+    w->trap.warnings = 0;
+    if (setjmp(w->trap.env) != 0) {
+        error_trap = saved;
+        w->failed = 1;
+        return -1;
+    }
+    error_trap = &w->trap;
+    if ((ret = create_fd(w->ctx, w->path, fd)) == -1) {
+        snprintf(w->trap.msg, sizeof(w->trap.msg), "%s: %s", name,
+                        errno == EINVAL ? "not a regular file" :
+                        strerror(errno));
+    }
+    error_trap = saved;
+    return ret == -1 || w->trap.warnings ? -1 : 0;
+}
+
+/*
+ * add the len bytes at data to the archive as a regular file called
+ * name, with the permissions in mode, modified at mtime and owned by
+ * whoever is running
+ */
+int mytar_add_buffer(struct mytar_writer *w, const char *name,
+                     const void *data, size_t len, mode_t mode, time_t mtime) {
+    struct error_trap *saved = error_trap;
+
+    if (w->failed || w->ctx == NULL) {
+        return -1;
+    }
+    free(w->path);
+    if ((w->path = strdup(name)) == NULL) {
+        snprintf(w->trap.msg, sizeof(w->trap.msg), "%s", strerror(errno));
+        return -1;
+    }
+    if (setjmp(w->trap.env) != 0) {
+        error_trap = saved;
+        w->failed = 1;
+        return -1;
+    }
+    error_trap = &w->trap;
+    create_buffer(w->ctx, w->path, data, len, mode, mtime);
+    error_trap = saved;
+    return 0;
+}
+
+/*
+ * end the archive and write out everything still buffered
+ * returns -1 if it couldn't be
+ */
+int mytar_writer_finish(struct mytar_writer *w) {
+    struct error_trap *saved = error_trap;
+
+    if (w->failed || w->ctx == NULL) {
+        return -1;
+    }
+    if (setjmp(w->trap.env) != 0) {
+        error_trap = saved;
+        w->failed = 1;
+        return -1;
+    }
+    error_trap = &w->trap;
+    create_close(w->ctx);
+    w->ctx = NULL;
+    error_trap = saved;
+    return 0;
+}
+
+/*
+ * what went wrong with the last call that returned an error
+ */
+const char *mytar_writer_error(struct mytar_writer *w) {
+    return w->trap.msg;
+}
+
+/*
+ * done writing (the fd stays open), finishing the archive first if
+ * mytar_writer_finish wasn't called
+ * after an error whatever the writer still had open is let go of and
+ * the archive is left as it is
+ */
+void mytar_writer_close(struct mytar_writer *w) {
+    if (mytar_writer_finish(w) == -1 && w->ctx != NULL) {
+        create_abort(w->ctx);
+    }
+    free(w->path);
+    free(w);
+}
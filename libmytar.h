@@ -0,0 +1,61 @@
+#ifndef _LIBMYTAR_H
+#define _LIBMYTAR_H
+
+/*
+ * reading and writing tar archives in-process, with libmytar.a or
+ * libmytar.so instead of running mytar
+ *
+ * the handles cover what an embedding program needs: members and their
+ * data streamed out of an archive, and files, fds or buffers added to a
+ * new one. They sit on the same code as the mytar modes, but mytar itself
+ * doesn't go through them: extracting to disk, -j, -g, --index and
+ * picking members by path have no handle calls
+ *
+ * nothing here exits or prints: calls that fail return -1 (or NULL) and
+ * mytar_reader_error/mytar_writer_error say why. After an error a handle
+ * can only be closed, which still frees everything it holds. A handle is
+ * only used by one thread at a time, but different threads can each have
+ * their own.
+ */
+
+#include <sys/types.h>
+#include <time.h>
+
+/* compression for mytar_writer_open, readers find it out themselves */
+#define MYTAR_NONE 0
+#define MYTAR_GZIP 1
+#define MYTAR_ZSTD 2
+
+/* a member of the archive being read, good until the next mytar_next */
+struct mytar_entry {
+    const char *path;
+    const char *linkpath;   /* target of a link, "" for anything else */
+    char type;              /* '0' file, '1' hard link, '2' symbolic link,
+                             * '5' directory, 'R' deleted (incremental) */
+    mode_t mode;            /* permission bits */
+    uid_t uid;
+    gid_t gid;
+    const char *uname;      /* "" if the archive doesn't have it */
+    const char *gname;
+    off_t size;             /* bytes of data mytar_read hands out */
+    struct timespec mtime;
+};
+
+struct mytar_reader;
+struct mytar_writer;
+
+struct mytar_reader *mytar_reader_open(int fd);
+int mytar_next(struct mytar_reader *r, struct mytar_entry *entry);
+ssize_t mytar_read(struct mytar_reader *r, void *buf, size_t n);
+const char *mytar_reader_error(struct mytar_reader *r);
+void mytar_reader_close(struct mytar_reader *r);
+
+struct mytar_writer *mytar_writer_open(int fd, int compress);
+int mytar_add_path(struct mytar_writer *w, const char *path);
+int mytar_add_fd(struct mytar_writer *w, const char *name, int fd);
+int mytar_add_buffer(struct mytar_writer *w, const char *name,
+                     const void *data, size_t len, mode_t mode, time_t mtime);
+int mytar_writer_finish(struct mytar_writer *w);
+const char *mytar_writer_error(struct mytar_writer *w);
+void mytar_writer_close(struct mytar_writer *w);
+#endif
@@ -23,92 +23,137 @@
 #include <time.h>
 
 #include "util.h"
+#include "codec.h"
+#include "pax.h"
+#include "archive.h"
+#include "match.h"
+#include "index.h"
 
 /*
  * seek to the next header by jumping over the file contents
  */
-void next_header(int tarfile, long size) {
+void next_header(struct archive_in *in, long size) {
     /* skip links and directories */
     if (size > 0) {
         /* seek by the number of blocks it takes to house the size */
-        if (lseek(tarfile, (size / BLOCK + 1) * BLOCK, SEEK_CUR) == -1) {
-            perror("mytar");
-            exit(EXIT_FAILURE);
-        } 
+        in_skip(in, BLOCK_ROUND(size));
     } 
 }
 
+/* stdout is written in chunks this big when it isn't a terminal */
+#define LIST_BUF 65536
+/* the widths printf("%10.10s %21.21s %8ld %16.16s %s\n") used to give */
+#define PERMS_WIDTH 10
+#define OWNER_WIDTH 21
+#define SIZE_WIDTH 8
+#define MTIME_WIDTH 16
+
+/*
+ * what the verbose list keeps from one member to the next, so it doesn't
+ * allocate or call localtime for each one
+ */
+struct listing {
+    char name[PATH_MAX_ + 2];
+    char owner[UGNAME_MAX * 2 + 2];
+    char line[128];             /* everything before the name */
+    /* mtimes from lo up to hi are on date, base seconds into it at lo */
+    time_t lo, hi;
+    long base;
+    char date[MTIME_STRLEN + 1];
+    size_t datelen;
+};
+
 /*
- * returns the name from the header provided
- * if paths are passed in, make sure any path is within or equal to the name
+ * returns the name from the header provided (or the extended header's path)
+ * if paths were given (sel), make sure the name is one of them or under one
  * else, return no name (NULL)
+ * the name is built in buf, which has room for PATH_MAX_ + 2
  */
-char *get_name(struct tarheader *head, char **paths, int npaths) {
-    char *name;
-    int i;
-    int found = 0;
-    
-    /* leave room for / and /0 */
-    if ((name = calloc(PATH_MAX_ + 2, sizeof(char))) == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
-    }
-    
+char *get_name(struct tarheader *head, char *path, struct selector *sel,
+               char *buf) {
+    char *name = buf;
+    size_t len = 0;
+
+    /* an extended header has the whole path */
+    if (path != NULL) {
+        name = path;
     /* if prefix is there, add prefix and name together */
-    if (head->prefix[0] != 0) {
-        strncpy(name, head->prefix, sizeof(head->prefix));
-        strcat(name, "/");
-        strncat(name, head->name, sizeof(head->name));
-    /* else, just use the name */
     } else {
-        strncpy(name, head->name, sizeof(head->name));
-    }
-    
-    /* check if any path arg is in the name */
-    if (paths != NULL) {
-        for (i = 0; i < npaths; i++) {
-            if (strncmp(name, paths[i], strlen(paths[i])) == 0) {
-                found = 1; /* bool is used so that we can search every path */
-                break;
-            }
-        }
-        /* if none found, return NULL to let the caller know */
-        if (!found) {
-            free(name);
-            return NULL;
+        if (head->prefix[0] != 0) {
+            len = strnlen(head->prefix, sizeof(head->prefix));
+            memcpy(buf, head->prefix, len);
+            buf[len++] = '/';
         }
+        memcpy(buf + len, head->name, sizeof(head->name));
+        buf[len + strnlen(head->name, sizeof(head->name))] = '\0';
+    }
+
+    /* check if the name is a path arg or under one,
+     * if not, return NULL to let the caller know */
+    if (sel != NULL &&
+            !selector_match(sel, name, head->typeflag[0] != DFLAG)) {
+        return NULL;
     }
 
     return name;
 }
 
 /*
- * returns the file perms formatted in a readable string like ls -l
+ * put s (len chars) right justified in a field width wide at p,
+ * cut down to width if it's longer, returns the end of the field
  */
-char *get_perms(struct tarheader *head) {
-    char *perms;
+char *put_field(char *p, const char *s, size_t len, size_t width) {
+    if (len > width) {
+        len = width;
+    }
+    memset(p, ' ', width - len);
+    memcpy(p + width - len, s, len);
+    return p + width;
+}
+
+/*
+ * write v in decimal so it ends just before end
+ * returns where it starts
+ */
+char *put_long(char *end, long v) {
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+    do {
+        *--end = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (v < 0) {
+        *--end = '-';
+    }
+    return end;
+}
+
+/*
+ * puts the file perms formatted in a readable string like ls -l in perms
+ * (PERM_STRLEN chars, not ended)
+ */
+void get_perms(struct tarheader *head, char *perms) {
     int mode;
     int mask = PERM_MASK;
     int i;
-    
+
     /* populate with the default (all perms provided) */
-    if ((perms = (char *)malloc(sizeof(char)*(PERM_STRLEN+1))) == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
-    }
-    strcpy(perms, "-rwxrwxrwx");
-    
+    memcpy(perms, "-rwxrwxrwx", PERM_STRLEN);
+
     /* convert mode back to decimal */
-    mode = strtol(head->mode, NULL, OCTAL);
+    mode = get_number(head->mode, sizeof(head->mode));
 
     /* if its a dir, put a d at the front */
     if (*(head->typeflag) == DFLAG) {
-        perms[0] = 'd'; 
+        perms[0] = 'd';
     /* if its a link, put an l at the front */
     } else if (*(head->typeflag) == LFLAG) {
         perms[0] = 'l';
+    /* hard links get an h */
+    } else if (*(head->typeflag) == HFLAG) {
+        perms[0] = 'h';
     }
-    
+
     /* if the bit isn't set, remove the corresponding per from the string */
     for (i = 0; i < PERM_STRLEN-1; i++) {
         if (!(mode & mask)) {
@@ -116,79 +161,131 @@ char *get_perms(struct tarheader *head) {
         }
         mask >>= 1;
     }
-
-    return perms;
 }
 
-/* 
- * returns the file mtime formatted in a readable string like ls -l
+/*
+ * convert mtm for the date it's on, which the members after it will
+ * mostly be on too
+ * the cache covers the whole day, or just the minute if the day has
+ * a daylight saving change in it
  */
-char *get_mtime(struct tarheader *head) {
-    long mtm;
-    char *mtime;
-    struct tm *tm;
-    
-    /* convert mtime back to decimal */
-    mtm = strtol(head->mtime, NULL, OCTAL);
+void cache_date(struct listing *l, time_t mtm) {
+    struct tm tm, first, last;
+    time_t end;
+    long secs;
 
-    /* if the special bit is set, recover the regular number instead */ 
-    if (mtm & SPECIAL_INT_MASK) {
-        mtm = extract_special_int(head->mtime, sizeof(head->mtime));
-    }
-    
-    /* the final string must fit within 17 chars because of the format */
-    if ((mtime = calloc(MTIME_STRLEN+1, sizeof(char))) == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
-    }
-    
     /* create the time structure to be able to format */
-    tm = localtime(&mtm);
-    
-    /* formats to a string like 2004-05-10 10:43 */
-    if (strftime(mtime, MTIME_STRLEN+1, "%Y-%m-%d %H:%M", tm) == 0) {
-        perror("mypwd");
-        exit(EXIT_FAILURE);
+    if (localtime_r(&mtm, &tm) == NULL) {
+        fail("mytar");
+    }
+
+    /* formats to a string like 2004-05-10 (and a space), which has to
+     * leave room for the time after it */
+    l->datelen = strftime(l->date, sizeof(l->date), "%Y-%m-%d ", &tm);
+    if (l->datelen == 0 || l->datelen + 5 > MTIME_STRLEN) {
+        fail("mypwd");
     }
 
-    return mtime;
+    secs = tm.tm_hour * 3600L + tm.tm_min * 60 + tm.tm_sec;
+    l->lo = mtm - secs;
+    l->hi = l->lo + 86400;
+    l->base = 0;
+    end = l->hi - 1;
+    if (localtime_r(&l->lo, &first) == NULL ||
+            localtime_r(&end, &last) == NULL ||
+            first.tm_gmtoff != tm.tm_gmtoff ||
+            last.tm_gmtoff != tm.tm_gmtoff) {
+        l->lo = mtm - tm.tm_sec;
+        l->hi = l->lo + 60;
+        l->base = secs - tm.tm_sec;
+    }
 }
 
 /*
- * returns the owner of the file formatted as user/group like ls -l
+ * puts the file mtime formatted in a readable string like ls -l in mtime
+ * returns its length
  */
-char *get_owner(struct tarheader *head) {
-    char *owner;
-    long uid, gid;
-    
-    /* must fit into 64 chars by the specification */
-    if ((owner = calloc(OWNER_STRLEN+1, sizeof(char))) == NULL) {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+size_t get_mtime(struct listing *l, struct tarheader *head, char *mtime) {
+    time_t mtm;
+    long secs;
+    int hour, min;
+
+    /* convert mtime back to decimal, octal or base-256 */
+    mtm = get_number(head->mtime, sizeof(head->mtime));
+    if (mtm < l->lo || mtm >= l->hi) {
+        cache_date(l, mtm);
     }
-    
+
+    /* then the time on that date, like 10:43 */
+    secs = l->base + (mtm - l->lo);
+    hour = secs / 3600;
+    min = secs / 60 % 60;
+    memcpy(mtime, l->date, l->datelen);
+    mtime += l->datelen;
+    mtime[0] = '0' + hour / 10;
+    mtime[1] = '0' + hour % 10;
+    mtime[2] = ':';
+    mtime[3] = '0' + min / 10;
+    mtime[4] = '0' + min % 10;
+    return l->datelen + 5;
+}
+
+/*
+ * puts the owner of the file formatted as user/group like ls -l in owner
+ * (which has room for both names), returns its length
+ */
+size_t get_owner(struct tarheader *head, char *owner) {
+    char *p, num[24];
+    size_t len;
+
     /* prefer to use the user name and group name in the header */
     if (head->uname[0] && head->gname[0]) {
         /* create the final string with the username and group name */
-        strcat(owner, head->uname);
-        strcat(owner, "/");
-        strcat(owner, head->gname);
+        len = strnlen(head->uname, sizeof(head->uname));
+        memcpy(owner, head->uname, len);
+        owner[len++] = '/';
+        p = head->gname;
+        memcpy(owner + len, p, strnlen(p, sizeof(head->gname)));
+        return len + strnlen(p, sizeof(head->gname));
+    }
+
     /* if not, just use the uid and gid */
-    } else {
-        uid = strtol(head->uid, NULL, OCTAL);
-        if (uid & SPECIAL_INT_MASK) {
-            extract_special_int(head->uid, sizeof(head->uid));
-        }
+    p = put_long(num + sizeof(num), get_number(head->uid, sizeof(head->uid)));
+    len = num + sizeof(num) - p;
+    memcpy(owner, p, len);
+    owner[len++] = '/';
+    p = put_long(num + sizeof(num), get_number(head->gid, sizeof(head->gid)));
+    memcpy(owner + len, p, num + sizeof(num) - p);
+    return len + (num + sizeof(num) - p);
+}
 
-        gid = strtol(head->gid, NULL, OCTAL);
-        if (gid & SPECIAL_INT_MASK) {
-            extract_special_int(head->gid, sizeof(head->gid));
-        }
-        /* format uid/gid into a string */
-        snprintf(owner, OWNER_STRLEN+1, "%ld/%ld", uid, gid);
+/*
+ * print the verbose line for a member, like
+ * -rw-r--r--            user/group     1234 2004-05-10 10:43 path
+ */
+void print_verbose(struct listing *l, struct tarheader *head, long size,
+                   char *name) {
+    char *p = l->line, *q, num[24], mtime[MTIME_STRLEN + 1];
+
+    get_perms(head, p);
+    p += PERMS_WIDTH;
+    *p++ = ' ';
+    p = put_field(p, l->owner, get_owner(head, l->owner), OWNER_WIDTH);
+    *p++ = ' ';
+    q = put_long(num + sizeof(num), size);
+    if (num + sizeof(num) - q < SIZE_WIDTH) {
+        p = put_field(p, q, num + sizeof(num) - q, SIZE_WIDTH);
+    } else {
+        memcpy(p, q, num + sizeof(num) - q);
+        p += num + sizeof(num) - q;
     }
+    *p++ = ' ';
+    p = put_field(p, mtime, get_mtime(l, head, mtime), MTIME_WIDTH);
+    *p++ = ' ';
 
-    return owner;
+    fwrite(l->line, 1, p - l->line, stdout);
+    fputs(name, stdout);
+    putchar('\n');
 }
 
 /*
@@ -197,81 +294,147 @@ char *get_owner(struct tarheader *head) {
 long get_size(struct tarheader *head) {
     long size;
 
-    /* convert back to decimal */
-    size = strtol(head->size, NULL, OCTAL);
-    /* if the special bit is set, extract the regular number instead */
-    if (size & SPECIAL_INT_MASK) {
-        size = extract_special_int(head->size, sizeof(head->size));
-    }
+    /* convert back to decimal, octal or base-256 */
+    size = get_number(head->size, sizeof(head->size));
 
     return size;
 }
 
+/*
+ * list the paths a global header says were deleted since the last
+ * incremental, marked so they can't pass for members
+ * only verbose listings show them, so a plain one matches GNU tar's,
+ * but they are matched either way for --occurrence
+ */
+void list_deleted(struct listing *l, struct tarheader *head,
+                  struct pax_attrs *attrs, struct selector *sel,
+                  int verbose) {
+    char *name;
+    int i;
+
+    for (i = 0; i < attrs->ndeleted; i++) {
+        if ((name = get_name(head, attrs->deleted[i], sel,
+                                                l->name)) == NULL) {
+            continue;
+        }
+        if (verbose) {
+            fputs("deleted: ", stdout);
+            fputs(name, stdout);
+            putchar('\n');
+        }
+    }
+}
+
 /*
  * list command mode accessed by the main function
  */
-void list(char *filename, char **paths, int npaths, int verbose, int strict) {
+void list(char *filename, char **paths, int npaths, struct options *opts) {
+    int verbose = opts->verbose, strict = opts->strict;
     char *c;
     int tarfile;
+    struct archive_in *in;
     struct tarheader head;
 
     char *name;
     long size;
-    char *perms;
-    char *mtime;
-    char *owner;
+    struct listing *l;
+    struct pax_attrs attrs;
+    struct selector *sel = NULL;
+    struct index_in *idx = NULL;
+    int extended = 0;
     
-    /* check if tarfile ends in .tar */
+    /* check if tarfile ends in .tar (or .tar.gz, .tgz, .tar.zst, .tzst) */
     if((c = strrchr(filename,'.')) != NULL ) {
-        if(strcmp(c,".tar") != 0) {
-            fprintf(stderr, "%s: file must be .tar\n", filename);
+        if ((strcmp(c, ".gz") == 0 || strcmp(c, ".zst") == 0) &&
+                c - filename >= 4 && strncmp(c - 4, ".tar", 4) == 0) {
+            c = ".tar";
+        }
+        if(strcmp(c,".tar") != 0 && strcmp(c, ".tgz") != 0 &&
+                strcmp(c, ".tzst") != 0) {
+            report_msg("%s: file must be .tar", filename);
         }
     } else {
-        perror("mytar");
-        exit(EXIT_FAILURE);
+        fail("mytar");
     }
     
     /* open just to read */
     if ((tarfile = open(filename, O_RDONLY)) == -1) {
-        perror(filename);
-        exit(EXIT_FAILURE);
+        fail(filename);
+    }
+    if ((l = calloc(1, sizeof(struct listing))) == NULL) {
+        fail("mytar");
+    }
+    tzset();
+    /* lines are small, write them out in big chunks unless someone is
+     * watching */
+    if (!isatty(STDOUT_FILENO)) {
+        setvbuf(stdout, NULL, _IOFBF, LIST_BUF);
+    }
+    in = in_open(tarfile);
+    /* list only needs the headers, read them out of a mapping */
+    in_map(in);
+    pax_init(&attrs);
+    if (paths != NULL) {
+        sel = selector_new(paths, npaths);
+        idx = index_open(filename, in, sel);
     }
     
-    /* we should only be reading in headers */
-    while (read(tarfile, &head, BLOCK) > 0) {
-        /* if end of archive is indicated, just return */
-        if (check_currupt_archive(tarfile, &head, strict) == 0) {
-            return;
+    /* we should only be reading in headers, with an index only those of
+     * the members asked for (and the extended headers before them) */
+    while ((idx == NULL || extended || index_next(idx, in)) &&
+            in_read(in, &head, BLOCK) > 0) {
+        /* if end of archive is indicated, just stop */
+        if (check_currupt_archive(in, &head, strict) == 0) {
+            break;
         }
+
+        /* extended headers just describe the member after them */
+        if (head.typeflag[0] == XHDFLAG || head.typeflag[0] == XGLFLAG) {
+            pax_read(in, &head, &attrs);
+            extended = 1;
+
+            /* or are all that's left of deleted paths */
+            if (attrs.ndeleted > 0) {
+                list_deleted(l, &head, &attrs, sel, verbose);
+                pax_clear(&attrs);
+                extended = 0;
+            }
+            continue;
+        }
+        extended = 0;
         
         /* so we can use next_header if needed next */
-        size = get_size(&head);
+        size = attrs.size >= 0 ? attrs.size : get_size(&head);
         
         /* if no name is returned, just find the next header and start again */
-        if ((name = get_name(&head, paths, npaths)) == NULL) {
-            next_header(tarfile, size);
+        if ((name = get_name(&head, attrs.path, sel, l->name)) == NULL) {
+            next_header(in, size);
+            pax_clear(&attrs);
             continue;
         }
         
         /* non-verbose -> just print the name */
         if (!verbose) {
-            printf("%s\n", name);      
+            fputs(name, stdout);
+            putchar('\n');
         } else {
-            /* grab all the info needed for the verbose list */
-            mtime = get_mtime(&head);
-            perms = get_perms(&head);
-            owner = get_owner(&head);    
-            
-            printf("%10.10s %21.21s %8ld %16.16s %s\n",
-                    perms, owner, size, mtime, name);
-            free(mtime);
-            free(perms);
-            free(owner);
+            /* sparse files show the size they really are */
+            print_verbose(l, &head,
+                    attrs.realsize >= 0 ? (long)attrs.realsize : size, name);
         }
-        free(name);
 
         /* always move to the next header */
-        next_header(tarfile, size);
+        next_header(in, size);
+        pax_clear(&attrs);
+
+        /* with --occurrence, nothing after what was asked for matters */
+        if (sel != NULL && opts->occurrence && selector_done(sel)) {
+            break;
+        }
     }
+    index_close(idx);
+    selector_free(sel);
+    in_close(in);
     close(tarfile);
+    free(l);
 }
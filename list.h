@@ -1,5 +1,11 @@
 #ifndef _LIST_H
 #define _LIST_H
 
-void list(char *filename, char **paths, int npaths, int verbose, int strict);
+#include "util.h"
+
+struct selector;
+
+char *get_name(struct tarheader *head, char *path, struct selector *sel,
+               char *buf);
+void list(char *filename, char **paths, int npaths, struct options *opts);
 #endif
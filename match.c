@@ -0,0 +1,411 @@
+/*
+ * file: match.c
+ *
+ * glob pattern sets, used by create to leave out paths (--exclude),
+ * and the paths extract and list are asked for
+ *
+ * a pattern without a slash matches the last part of a path, so
+ * "*.o" leaves out every object file and ".git" every .git directory.
+ * A pattern with a slash matches the whole path, or the end of it
+ * starting at any slash, so "build/tmp" matches "src/build/tmp" too.
+ *
+ * most patterns are plain names or "*.ext", which are found with a
+ * hash lookup, so thousands of them cost about as much as one
+ *
+ * a path given to extract or list picks out that member and everything
+ * under it, so a member is looked up once for each of its leading
+ * directories, not compared with every path given
+ */
+
+#define _GNU_SOURCE
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "match.h"
+
+#define MATCH_BUCKETS 64
+
+/*
+ * FNV-1a hash of len bytes of s
+ */
+size_t hash_bytes(const char *s, size_t len) {
+    size_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * find len bytes at s in the set, NULL if it isn't there
+ */
+struct match_str *set_find(struct match_set *set, const char *s, size_t len) {
+    struct match_str *e;
+
+    if (set->count == 0) {
+        return NULL;
+    }
+    for (e = set->buckets[hash_bytes(s, len) & (set->nbuckets - 1)];
+                        e != NULL; e = e->next) {
+        if (e->len == len && memcmp(e->str, s, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * is len bytes at s in the set?
+ */
+int set_has(struct match_set *set, const char *s, size_t len) {
+    return set_find(set, s, len) != NULL;
+}
+
+/*
+ * add a copy of len bytes at s to the set, if it isn't there
+ * returns the string in the set, a new one has a value of -1
+ */
+struct match_str *set_add(struct match_set *set, const char *s, size_t len) {
+    struct match_str *e, *next, **buckets;
+    size_t i, nbuckets;
+
+    if ((e = set_find(set, s, len)) != NULL) {
+        return e;
+    }
+
+    /* double the table once it averages two strings a bucket */
+    if (set->count >= set->nbuckets * 2) {
+        nbuckets = set->nbuckets ? set->nbuckets * 2 : MATCH_BUCKETS;
+        if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL) {
+            fail("mytar");
+        }
+        for (i = 0; i < set->nbuckets; i++) {
+            for (e = set->buckets[i]; e != NULL; e = next) {
+                next = e->next;
+                e->next = buckets[hash_bytes(e->str, e->len) &
+                                                    (nbuckets - 1)];
+                buckets[hash_bytes(e->str, e->len) & (nbuckets - 1)] = e;
+            }
+        }
+        free(set->buckets);
+        set->buckets = buckets;
+        set->nbuckets = nbuckets;
+    }
+
+    if ((e = malloc(sizeof(struct match_str))) == NULL ||
+            (e->str = malloc(len + 1)) == NULL) {
+        fail("mytar");
+    }
+    memcpy(e->str, s, len);
+    e->str[len] = '\0';
+    e->len = len;
+    e->value = -1;
+    e->next = set->buckets[hash_bytes(s, len) & (set->nbuckets - 1)];
+    set->buckets[hash_bytes(s, len) & (set->nbuckets - 1)] = e;
+    set->count++;
+    return e;
+}
+
+/*
+ * empty the set, it can be added to again after
+ */
+void set_free(struct match_set *set) {
+    struct match_str *e, *next;
+    size_t i;
+
+    for (i = 0; i < set->nbuckets; i++) {
+        for (e = set->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->str);
+            free(e);
+        }
+    }
+    free(set->buckets);
+    set->buckets = NULL;
+    set->nbuckets = 0;
+    set->count = 0;
+}
+
+/*
+ * does the pattern have anything fnmatch treats specially?
+ */
+int has_wildcard(const char *s) {
+    return strpbrk(s, "*?[\\") != NULL;
+}
+
+/*
+ * add a pattern to a list for fnmatch
+ */
+void add_glob(char ***globs, int *n, char *pattern) {
+    if ((*globs = realloc(*globs, (*n + 1) * sizeof(char *))) == NULL ||
+            ((*globs)[*n] = strdup(pattern)) == NULL) {
+        fail("mytar");
+    }
+    (*n)++;
+}
+
+struct matcher *matcher_new(void) {
+    struct matcher *m;
+
+    if ((m = calloc(1, sizeof(struct matcher))) == NULL) {
+        fail("mytar");
+    }
+    return m;
+}
+
+/*
+ * add a pattern, sorting it into whichever set matches it fastest
+ */
+void matcher_add(struct matcher *m, char *pattern) {
+    size_t len;
+    int i;
+
+    /* "./a" is "a", and a slash on the end doesn't change anything */
+    while (strncmp(pattern, "./", 2) == 0) {
+        pattern += 2;
+    }
+    len = strlen(pattern);
+    while (len > 1 && pattern[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    if (memchr(pattern, '/', len) != NULL) {
+        if (!has_wildcard(pattern)) {
+            set_add(&m->paths, pattern, len);
+        } else {
+            pattern = strndup(pattern, len);
+            add_glob(&m->path_globs, &m->npath_globs, pattern);
+            free(pattern);
+        }
+    } else if (!has_wildcard(pattern)) {
+        set_add(&m->names, pattern, len);
+    } else if (pattern[0] == '*' && !has_wildcard(pattern + 1)) {
+        /* "*.o" is just a suffix, the lengths tell us where to look */
+        set_add(&m->suffixes, pattern + 1, len - 1);
+        for (i = 0; i < m->nsuffix_lens; i++) {
+            if (m->suffix_lens[i] == len - 1) {
+                return;
+            }
+        }
+        if ((m->suffix_lens = realloc(m->suffix_lens,
+                        (m->nsuffix_lens + 1) * sizeof(size_t))) == NULL) {
+            fail("mytar");
+        }
+        m->suffix_lens[m->nsuffix_lens++] = len - 1;
+    } else {
+        pattern = strndup(pattern, len);
+        add_glob(&m->globs, &m->nglobs, pattern);
+        free(pattern);
+    }
+}
+
+/*
+ * add every pattern in a file, one a line
+ * returns -1 if the file can't be read
+ */
+int matcher_add_file(struct matcher *m, char *filename) {
+    FILE *file;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if ((file = fopen(filename, "r")) == NULL) {
+        return -1;
+    }
+    while ((len = getline(&line, &cap, file)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        matcher_add(m, line);
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+/*
+ * does any pattern match path, whose last part is name?
+ * a slash on the end of path is ignored
+ */
+int matcher_match(struct matcher *m, char *path, char *name) {
+    size_t len, namelen = strlen(name);
+    char *p, *whole = NULL;
+    int i, found = 0;
+
+    if (namelen > 1 && name[namelen - 1] == '/') {
+        namelen--;
+    }
+    if (set_has(&m->names, name, namelen)) {
+        return 1;
+    }
+    for (i = 0; i < m->nsuffix_lens; i++) {
+        len = m->suffix_lens[i];
+        if (len <= namelen &&
+                set_has(&m->suffixes, name + namelen - len, len)) {
+            return 1;
+        }
+    }
+
+    /* fnmatch needs the strings to end where we do */
+    if (name[namelen] != '\0') {
+        name = whole = strndup(name, namelen);
+    }
+    for (i = 0; i < m->nglobs && !found; i++) {
+        found = fnmatch(m->globs[i], name, 0) == 0;
+    }
+    free(whole);
+    if (found || (m->paths.count == 0 && m->npath_globs == 0)) {
+        return found;
+    }
+
+    /* whole path patterns, tried at the start and after every slash */
+    len = strlen(path);
+    if (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    if ((whole = strndup(path, len)) == NULL) {
+        fail("mytar");
+    }
+    for (p = whole; p != NULL && !found; p = strchr(p, '/')) {
+        if (*p == '/') {
+            p++;
+        }
+        found = set_has(&m->paths, p, whole + len - p);
+        for (i = 0; i < m->npath_globs && !found; i++) {
+            found = fnmatch(m->path_globs[i], p, 0) == 0;
+        }
+    }
+    free(whole);
+    return found;
+}
+
+/*
+ * make a selector for the paths given to extract or list
+ */
+struct selector *selector_new(char **paths, int npaths) {
+    struct selector *s;
+    size_t len;
+    char *p;
+    int i;
+
+    if ((s = calloc(1, sizeof(struct selector))) == NULL) {
+        fail("mytar");
+    }
+    for (i = 0; i < npaths; i++) {
+        /* "./a" is "a", and a slash on the end doesn't change anything */
+        for (p = paths[i]; strncmp(p, "./", 2) == 0; p += 2)
+            ;
+        len = strlen(p);
+        while (len > 1 && p[len - 1] == '/') {
+            len--;
+        }
+        /* "." is the whole archive */
+        if (len == 0 || (len == 1 && p[0] == '.')) {
+            add_glob(&s->globs, &s->nglobs, "*");
+        } else if (!has_wildcard(p)) {
+            set_add(&s->paths, p, len);
+        } else {
+            p = strndup(p, len);
+            add_glob(&s->globs, &s->nglobs, p);
+            free(p);
+        }
+    }
+    return s;
+}
+
+/*
+ * is the member name one of the paths given, or under one of them?
+ * last: nothing can be under the member (it isn't a directory), so if
+ * it's a path given exactly, that path has been found
+ */
+int selector_match(struct selector *s, char *name, int last) {
+    struct match_str *e;
+    size_t len, i;
+    char *whole;
+    int found = 0, g;
+
+    while (strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+    len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') {
+        len--;
+    }
+
+    /* the name itself, then each directory leading to it */
+    if ((e = set_find(&s->paths, name, len)) != NULL) {
+        if (last && e->value == -1) {
+            e->value = 1;
+            s->found++;
+        }
+        return 1;
+    }
+    for (i = 1; i < len; i++) {
+        if (name[i] == '/' && set_has(&s->paths, name, i)) {
+            return 1;
+        }
+    }
+    if (s->nglobs == 0) {
+        return 0;
+    }
+
+    /* a pattern matching a leading directory matches what's in it too */
+    if ((whole = strndup(name, len)) == NULL) {
+        fail("mytar");
+    }
+    for (g = 0; g < s->nglobs && !found; g++) {
+        found = fnmatch(s->globs[g], whole, FNM_LEADING_DIR) == 0;
+    }
+    free(whole);
+    return found;
+}
+
+/*
+ * has every path given been found as a member nothing can be under?
+ * never with a wildcard, that could always match something later
+ */
+int selector_done(struct selector *s) {
+    return s->nglobs == 0 && s->found == s->paths.count;
+}
+
+void selector_free(struct selector *s) {
+    int i;
+
+    if (s == NULL) {
+        return;
+    }
+    set_free(&s->paths);
+    for (i = 0; i < s->nglobs; i++) {
+        free(s->globs[i]);
+    }
+    free(s->globs);
+    free(s);
+}
+
+void matcher_free(struct matcher *m) {
+    int i;
+
+    if (m == NULL) {
+        return;
+    }
+    set_free(&m->names);
+    set_free(&m->suffixes);
+    set_free(&m->paths);
+    for (i = 0; i < m->nglobs; i++) {
+        free(m->globs[i]);
+    }
+    for (i = 0; i < m->npath_globs; i++) {
+        free(m->path_globs[i]);
+    }
+    free(m->globs);
+    free(m->path_globs);
+    free(m->suffix_lens);
+    free(m);
+}
@@ -0,0 +1,63 @@
+#ifndef _MATCH_H
+#define _MATCH_H
+
+#include <stddef.h>
+
+/* one literal string in a pattern set */
+struct match_str {
+    char *str;
+    size_t len;
+    int value;              /* for sets used as a map, -1 until set */
+    struct match_str *next;
+};
+
+/* a hash set of literal strings */
+struct match_set {
+    struct match_str **buckets;
+    size_t nbuckets;        /* a power of two */
+    size_t count;
+};
+
+/*
+ * a set of glob patterns, sorted by how they can be matched:
+ * plain names and "*suffix" patterns are hash lookups,
+ * only the rest go through fnmatch
+ * patterns with a slash match the whole path, the rest the last part
+ */
+struct matcher {
+    struct match_set names;     /* "node_modules" */
+    struct match_set suffixes;  /* "*.o", stored as ".o" */
+    size_t *suffix_lens;        /* each length in suffixes, once */
+    int nsuffix_lens;
+    struct match_set paths;     /* "src/gen", no wildcards */
+    char **globs;               /* everything else, for fnmatch */
+    int nglobs;
+    char **path_globs;          /* the same, with a slash */
+    int npath_globs;
+};
+
+/*
+ * the paths given to extract or list, each picks out that member
+ * and everything under it
+ */
+struct selector {
+    struct match_set paths; /* no wildcards, the value is 1 once found */
+    size_t found;           /* how many of them have been */
+    char **globs;           /* the rest, for fnmatch */
+    int nglobs;
+};
+
+struct match_str *set_find(struct match_set *set, const char *s, size_t len);
+int set_has(struct match_set *set, const char *s, size_t len);
+struct match_str *set_add(struct match_set *set, const char *s, size_t len);
+void set_free(struct match_set *set);
+struct matcher *matcher_new(void);
+void matcher_add(struct matcher *m, char *pattern);
+int matcher_add_file(struct matcher *m, char *filename);
+int matcher_match(struct matcher *m, char *path, char *name);
+void matcher_free(struct matcher *m);
+struct selector *selector_new(char **paths, int npaths);
+int selector_match(struct selector *s, char *name, int last);
+int selector_done(struct selector *s);
+void selector_free(struct selector *s);
+#endif
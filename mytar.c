@@ -9,13 +9,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include "create.h"
 #include "list.h"
 #include "extract.h"
+#include "archive.h"
+#include "compress.h"
+#include "match.h"
 
 #define OPSMIN 2
-#define OPSMAX 4
+#define OPSMAX 5
 
 /* for position in argv */
 #define OPS 1
@@ -26,13 +30,144 @@
  * print the usage message error
  */
 void print_usage(void) {
-    fprintf(stderr, "usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+    fprintf(stderr, "usage: mytar [ctxvSzZ]f tarfile [ options ] "
+                    "[ path [ ... ] ]\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -j N    use N threads to read and compress "
+                    "(create), or to write files (extract)\n");
+    fprintf(stderr, "  -b N    write records of N 512 byte blocks "
+                    "(create, max %d)\n", MAX_BLOCKING);
+    fprintf(stderr, "  -g FILE incremental create against snapshot FILE\n");
+    fprintf(stderr, "  --numeric-owner    "
+                    "leave user/group names out of headers (create)\n");
+    fprintf(stderr, "  --posix            "
+                    "keep mtimes to the nanosecond in extended headers "
+                    "(create)\n");
+    fprintf(stderr, "  --align            "
+                    "start file data at 4 KiB offsets so extract can clone "
+                    "it (create)\n");
+    fprintf(stderr, "  --occurrence       "
+                    "stop reading once each path given has been found "
+                    "(extract, list)\n");
+    fprintf(stderr, "  --index            "
+                    "write an index so list and extract can go straight "
+                    "to the paths given (create)\n");
+    fprintf(stderr, "  --exclude=PATTERN  "
+                    "leave out paths matching PATTERN (create)\n");
+    fprintf(stderr, "  --exclude-from=FILE"
+                    "  leave out paths matching patterns in FILE (create)\n");
+    fprintf(stderr, "  --sort=ORDER       "
+                    "read each directory in none, inode or disk order "
+                    "(create)\n");
     exit(EXIT_FAILURE);
 }
 
+/*
+ * parse a positive integer argument for an option, or die with the usage
+ */
+int parse_count(char *opt, char *arg) {
+    char *end;
+    long val;
+
+    if (arg == NULL) {
+        fprintf(stderr, "mytar: option %s requires an argument\n", opt);
+        print_usage();
+    }
+    val = strtol(arg, &end, 10);
+    if (*end != '\0' || val < 1 || val > INT_MAX) {
+        fprintf(stderr, "mytar: invalid argument for %s: %s\n", opt, arg);
+        print_usage();
+    }
+    return (int)val;
+}
+
+/*
+ * the argument of a long option, after its = or else the next arg
+ */
+char *option_arg(char *argv[], int *i, char *opt) {
+    size_t len = strlen(opt);
+
+    if (argv[*i][len] == '=') {
+        return argv[*i] + len + 1;
+    }
+    if (argv[*i + 1] == NULL) {
+        fprintf(stderr, "mytar: option %s requires an argument\n", opt);
+        print_usage();
+    }
+    return argv[++(*i)];
+}
+
+/*
+ * options come after the tarfile and before the paths
+ * returns the index in argv of the first path
+ */
+int parse_options(int argc, char *argv[], struct options *opts) {
+    char *arg;
+    int i;
+
+    for (i = PATHS; i < argc && argv[i][0] == '-'; i++) {
+        /* -- ends the options so paths can start with a dash */
+        if (strcmp(argv[i], "--") == 0) {
+            return i + 1;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            opts->jobs = parse_count(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            opts->blocking = parse_count(argv[i], argv[i + 1]);
+            if (opts->blocking > MAX_BLOCKING) {
+                fprintf(stderr, "mytar: blocking factor too large\n");
+                print_usage();
+            }
+            i++;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            if ((opts->snapshot = argv[i + 1]) == NULL) {
+                fprintf(stderr, "mytar: option -g requires an argument\n");
+                print_usage();
+            }
+            i++;
+        } else if (strcmp(argv[i], "--numeric-owner") == 0) {
+            opts->numeric_owner = 1;
+        } else if (strcmp(argv[i], "--posix") == 0) {
+            opts->posix = 1;
+        } else if (strcmp(argv[i], "--align") == 0) {
+            opts->align = 1;
+        } else if (strcmp(argv[i], "--occurrence") == 0) {
+            opts->occurrence = 1;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            opts->index = 1;
+        } else if (strcmp(argv[i], "--exclude") == 0 ||
+                strncmp(argv[i], "--exclude=", 10) == 0) {
+            if (opts->exclude == NULL) {
+                opts->exclude = matcher_new();
+            }
+            matcher_add(opts->exclude, option_arg(argv, &i, "--exclude"));
+        } else if (strcmp(argv[i], "--exclude-from") == 0 ||
+                strncmp(argv[i], "--exclude-from=", 15) == 0) {
+            if (opts->exclude == NULL) {
+                opts->exclude = matcher_new();
+            }
+            arg = option_arg(argv, &i, "--exclude-from");
+            if (matcher_add_file(opts->exclude, arg) == -1) {
+                perror(arg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--sort=none") == 0) {
+            opts->sort = SORT_NONE;
+        } else if (strcmp(argv[i], "--sort=inode") == 0) {
+            opts->sort = SORT_INODE;
+        } else if (strcmp(argv[i], "--sort=disk") == 0) {
+            opts->sort = SORT_DISK;
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            print_usage();
+        }
+    }
+    return i;
+}
+
 int main(int argc, char *argv[]) {
-    int verbose=0, strict=0; /* booleans for v and S option */
-    int i, j;
+    struct options opts = {0};
+    int i, j, first;
     char **paths;
     char *file;
     int nops;
@@ -59,9 +194,13 @@ int main(int argc, char *argv[]) {
         if (argv[1][i] == '\0') {
             print_usage();
         } else if (argv[OPS][i] == 'v') {
-            verbose = 1;
+            opts.verbose = 1;
         } else if (argv[OPS][i] == 'S') {
-            strict = 1;
+            opts.strict = 1;
+        } else if (argv[OPS][i] == 'z') {
+            opts.compress = COMP_GZIP;
+        } else if (argv[OPS][i] == 'Z') {
+            opts.compress = COMP_ZSTD;
         } else {
             /* catch an unknown option */
             fprintf(stderr, "unknown option: %c\n", argv[OPS][i]);
@@ -71,18 +210,20 @@ int main(int argc, char *argv[]) {
     
     /* the .tar archive file */
     file = argv[TFILE];
+
+    first = parse_options(argc, argv, &opts);
     
     /* no paths specified */ 
-    if ((argc - PATHS) == 0) {
+    if ((argc - first) == 0) {
         paths = NULL;
         i = 0;
     } else {
-        if ((paths = malloc((sizeof(char *)) * (argc - PATHS))) == NULL) {
+        if ((paths = malloc((sizeof(char *)) * (argc - first))) == NULL) {
             perror("mytar");
             exit(EXIT_FAILURE);
         }
 
-        for (i=0, j=PATHS; j < argc; i++, j++) {
+        for (i=0, j=first; j < argc; i++, j++) {
             paths[i] = argv[j];
         } 
     } 
@@ -90,16 +231,17 @@ int main(int argc, char *argv[]) {
     /* find out which mode to enter based on cvx */
     switch(argv[OPS][0]) {
         case 'c':
-            create(file, paths, i, verbose, strict);
+            create(file, paths, i, &opts);
             break;
         case 't':
-            list(file, paths, i, verbose, strict);
+            list(file, paths, i, &opts);
             break;
         case 'x':
-            extract(file, paths, i, verbose, strict); 
+            extract(file, paths, i, &opts); 
             break;
     }
 
     free(paths);
+    matcher_free(opts.exclude);
     return 0;
 }
@@ -0,0 +1,344 @@
+/*
+ * file: pax.c
+ *
+ * POSIX pax extended headers, used for what a plain ustar header
+ * can't hold (long paths and link targets, mtimes finer than a second,
+ * the map of a sparse file)
+ *
+ * an extended header is a member of type 'x' whose data is a list of
+ * "length key=value\n" records applying to the member right after it
+ *
+ * global headers (type 'g') apply to the rest of the archive. The only
+ * thing we read from them is PAX_DELETED, which incrementals use to
+ * record deleted paths where other tars will skip over them
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pax.h"
+#include "archive.h"
+#include "codec.h"
+
+/*
+ * number of decimal digits in n
+ */
+int digits(size_t n) {
+    int d = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        d++;
+    }
+    return d;
+}
+
+/*
+ * append a "length key=value\n" record
+ * the length counts itself, so it may need an extra digit
+ */
+void pax_add(struct pax_out *p, const char *key, const char *value) {
+    size_t klen = strlen(key), vlen = strlen(value);
+    size_t n, total;
+
+    /* space, equals and newline */
+    n = klen + vlen + 3;
+    total = n + digits(n);
+    if (digits(total) > digits(n)) {
+        total++;
+    }
+
+    if (p->len + total + 1 > p->cap) {
+        p->cap = (p->len + total + 1) * 2;
+        if ((p->buf = realloc(p->buf, p->cap)) == NULL) {
+            fail("mytar");
+        }
+    }
+    p->len += sprintf(p->buf + p->len, "%zu %s=%s\n", total, key, value);
+}
+
+/*
+ * append a comment record exactly len bytes long (at least PAX_PAD_MIN)
+ * readers skip comments, so it only moves what comes after it
+ */
+void pax_add_pad(struct pax_out *p, size_t len) {
+    int n;
+
+    if (p->len + len + 1 > p->cap) {
+        p->cap = (p->len + len + 1) * 2;
+        if ((p->buf = realloc(p->buf, p->cap)) == NULL) {
+            fail("mytar");
+        }
+    }
+    n = sprintf(p->buf + p->len, "%zu comment=", len);
+    memset(p->buf + p->len + n, ' ', len - n - 1);
+    p->buf[p->len + len - 1] = '\n';
+    p->len += len;
+}
+
+/*
+ * append a record with a decimal value
+ */
+void pax_add_num(struct pax_out *p, const char *key, long long val) {
+    char num[24];
+
+    sprintf(num, "%lld", val);
+    pax_add(p, key, num);
+}
+
+/*
+ * append a record with a time in seconds, and nanoseconds if it has any
+ */
+void pax_add_time(struct pax_out *p, const char *key, struct timespec *ts) {
+    char num[32];
+
+    if (ts->tv_nsec == 0) {
+        sprintf(num, "%lld", (long long)ts->tv_sec);
+    } else {
+        sprintf(num, "%lld.%09ld", (long long)ts->tv_sec, ts->tv_nsec);
+    }
+    pax_add(p, key, num);
+}
+
+/*
+ * make the name of a helper member for path: dir/<dir>/base
+ * like "a/b/PaxHeaders/c" for "a/b/c"
+ */
+void pax_name(char *buf, size_t size, const char *path, const char *dir) {
+    const char *base;
+    size_t len = strlen(path);
+
+    /* ignore the slash on the end of a directory */
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    for (base = path + len; base > path && base[-1] != '/'; base--)
+        ;
+    snprintf(buf, size, "%.*s%s/%.*s", (int)(base - path), path, dir,
+                (int)(path + len - base), base);
+}
+
+void pax_init(struct pax_attrs *attrs) {
+    attrs->path = NULL;
+    attrs->linkpath = NULL;
+    attrs->size = -1;
+    attrs->mtime.tv_sec = 0;
+    attrs->mtime.tv_nsec = -1;
+    attrs->realsize = -1;
+    attrs->sparse_major = 0;
+    attrs->sparse_minor = 0;
+    attrs->deleted = NULL;
+    attrs->ndeleted = 0;
+}
+
+/*
+ * forget the attributes once the member they belong to is done
+ */
+void pax_clear(struct pax_attrs *attrs) {
+    int i;
+
+    for (i = 0; i < attrs->ndeleted; i++) {
+        free(attrs->deleted[i]);
+    }
+    free(attrs->deleted);
+    free(attrs->path);
+    free(attrs->linkpath);
+    pax_init(attrs);
+}
+
+/*
+ * parse a pax time, seconds with an optional fraction
+ */
+void pax_parse_time(char *value, struct timespec *ts) {
+    char *p;
+    long ns = 0;
+    int i;
+
+    ts->tv_sec = strtoll(value, &p, 10);
+    if (*p == '.') {
+        /* only the first nine digits fit in nanoseconds */
+        for (i = 0, p++; i < 9; i++) {
+            ns *= 10;
+            if (*p >= '0' && *p <= '9') {
+                ns += *p++ - '0';
+            }
+        }
+    }
+    ts->tv_nsec = ns;
+}
+
+/*
+ * save one record, unknown keys are ignored
+ */
+void pax_set(struct pax_attrs *attrs, char *key, char *value, size_t vlen) {
+    char *copy;
+
+    if ((copy = malloc(vlen + 1)) == NULL) {
+        fail("mytar");
+    }
+    memcpy(copy, value, vlen);
+    copy[vlen] = '\0';
+
+    if (strcmp(key, PAX_DELETED) == 0) {
+        attrs->deleted = realloc(attrs->deleted,
+                            (attrs->ndeleted + 1) * sizeof(char *));
+        if (attrs->deleted == NULL) {
+            fail("mytar");
+        }
+        attrs->deleted[attrs->ndeleted++] = copy;
+        return;
+    }
+
+    if (strcmp(key, "path") == 0 || strcmp(key, "GNU.sparse.name") == 0) {
+        free(attrs->path);
+        attrs->path = copy;
+        return;
+    }
+    if (strcmp(key, "linkpath") == 0) {
+        free(attrs->linkpath);
+        attrs->linkpath = copy;
+        return;
+    }
+    if (strcmp(key, "size") == 0) {
+        attrs->size = strtoll(copy, NULL, 10);
+    } else if (strcmp(key, "mtime") == 0) {
+        pax_parse_time(copy, &attrs->mtime);
+    } else if (strcmp(key, "GNU.sparse.realsize") == 0) {
+        attrs->realsize = strtoll(copy, NULL, 10);
+    } else if (strcmp(key, "GNU.sparse.major") == 0) {
+        attrs->sparse_major = atoi(copy);
+    } else if (strcmp(key, "GNU.sparse.minor") == 0) {
+        attrs->sparse_minor = atoi(copy);
+    }
+    free(copy);
+}
+
+/*
+ * read the data of the extended header in head and keep its records
+ * leaves the archive at the header of the member it describes
+ * a global header deleting paths stands in for members itself, the
+ * paths are then in attrs->deleted
+ */
+void pax_read(struct archive_in *in, struct tarheader *head,
+                                struct pax_attrs *attrs) {
+    long size;
+    size_t len;
+    char *data, *p, *end, *key, *eq;
+
+    size = get_number(head->size, SIZE_SIZE);
+    if (size < 0 || (data = malloc(BLOCK_ROUND(size) + 1)) == NULL) {
+        fail("mytar");
+    }
+    /* data is freed before failing, a library reader carries on after */
+    if (in_read(in, data, BLOCK_ROUND(size)) != BLOCK_ROUND(size)) {
+        free(data);
+        fail_msg("error: currupted archive");
+    }
+    data[size] = '\0';
+
+    for (p = data, end = data + size; p < end; p += len) {
+        len = strtoul(p, &key, 10);
+        if (len == 0 || *key != ' ' || p + len > end || p[len - 1] != '\n' ||
+                (eq = memchr(key + 1, '=', p + len - key - 1)) == NULL) {
+            free(data);
+            fail_msg("error: currupted extended header");
+        }
+        key++;
+        *eq = '\0';
+
+        /* the rest of a global header only matters to the members we
+         * don't keep */
+        if (head->typeflag[0] != XGLFLAG || strcmp(key, PAX_DELETED) == 0) {
+            pax_set(attrs, key, eq + 1, p + len - 1 - (eq + 1));
+        }
+    }
+
+    free(data);
+}
+
+/*
+ * read the next decimal number of a GNU 1.0 sparse map, which comes
+ * before a sparse member's data, reading in the next block of the map
+ * when this one runs out (pos starts at BLOCK)
+ * left is how much of the member hasn't been read, the map can't run
+ * past it
+ */
+long long read_map_number(struct archive_in *in, char *block, int *pos,
+                          long long *left) {
+    long long val = 0;
+    int digit;
+
+    for (;;) {
+        if (*pos == BLOCK) {
+            if (*left < BLOCK) {
+                fail_msg("error: currupted sparse map");
+            }
+            if (in_read(in, block, BLOCK) != BLOCK) {
+                fail_msg("error: currupted archive");
+            }
+            *left -= BLOCK;
+            *pos = 0;
+        }
+        /* every number ends in a newline */
+        if (block[*pos] == '\n') {
+            (*pos)++;
+            return val;
+        }
+        if (block[*pos] < '0' || block[*pos] > '9') {
+            fail_msg("error: currupted sparse map");
+        }
+        digit = block[(*pos)++] - '0';
+        if (val > (LLONG_MAX - digit) / 10) {
+            fail_msg("error: currupted sparse map");
+        }
+        val = val * 10 + digit;
+    }
+}
+
+/*
+ * read the map of data regions at the start of a GNU 1.0 sparse member,
+ * leaving the archive at the data
+ * stored is the member's size in the archive and realsize the size of
+ * the file: the map and the data have to fit in the member, and the
+ * regions have to be in order and inside the file
+ * the offset/size pairs go in *mapp, how many in nregions and the bytes of
+ * data after the map in datalen. *mapp is set before anything in the map
+ * is checked, so the caller frees it even if this fails
+ */
+void pax_read_map(struct archive_in *in, long long stored,
+                  long long realsize, long long **mapp,
+                  long long *nregions, long long *datalen) {
+    char block[BLOCK];
+    int pos = BLOCK;
+    long long *map, i, end = 0, left = stored;
+
+    /* each region takes at least "0\n0\n" of the member */
+    *nregions = read_map_number(in, block, &pos, &left);
+    if (*nregions > stored / 4 ||
+            (uint64_t)*nregions > SIZE_MAX / (2 * sizeof(long long))) {
+        fail_msg("error: currupted sparse map");
+    }
+    if ((map = malloc(2 * *nregions * sizeof(long long) + 1)) == NULL) {
+        fail("mytar");
+    }
+    *mapp = map;
+
+    *datalen = 0;
+    for (i = 0; i < *nregions; i++) {
+        map[2 * i] = read_map_number(in, block, &pos, &left);
+        map[2 * i + 1] = read_map_number(in, block, &pos, &left);
+        if (map[2 * i] < end || map[2 * i] > realsize ||
+                map[2 * i + 1] > realsize - map[2 * i]) {
+            fail_msg("error: currupted sparse map");
+        }
+        end = map[2 * i] + map[2 * i + 1];
+        *datalen += map[2 * i + 1];
+    }
+    if (*datalen > left) {
+        fail_msg("error: currupted sparse map");
+    }
+}
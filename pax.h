@@ -0,0 +1,49 @@
+#ifndef _PAX_H
+#define _PAX_H
+
+#include <time.h>
+
+#include "util.h"
+
+#define XHDFLAG 'x'
+#define XGLFLAG 'g'
+/* global header record naming a path deleted since the last incremental */
+#define PAX_DELETED "MYTAR.deleted"
+/* the shortest padding record, "12 comment=\n" */
+#define PAX_PAD_MIN 12
+
+/* records for one extended header, the buffer is reused between members */
+struct pax_out {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/* what the extended headers before a member said about it */
+struct pax_attrs {
+    char *path;             /* replaces name/prefix, NULL if not given */
+    char *linkpath;         /* replaces linkname, NULL if not given */
+    long long size;         /* replaces the size field, -1 if not given */
+    struct timespec mtime;  /* exact mtime, tv_nsec is -1 if not given */
+    long long realsize;     /* GNU.sparse.realsize, -1 if not sparse */
+    int sparse_major;
+    int sparse_minor;
+    char **deleted;         /* paths a global header deleted (PAX_DELETED) */
+    int ndeleted;
+};
+
+void pax_add(struct pax_out *p, const char *key, const char *value);
+void pax_add_num(struct pax_out *p, const char *key, long long val);
+void pax_add_pad(struct pax_out *p, size_t len);
+void pax_add_time(struct pax_out *p, const char *key, struct timespec *ts);
+void pax_name(char *buf, size_t size, const char *path, const char *dir);
+void pax_init(struct pax_attrs *attrs);
+void pax_clear(struct pax_attrs *attrs);
+void pax_read(struct archive_in *in, struct tarheader *head,
+                                struct pax_attrs *attrs);
+long long read_map_number(struct archive_in *in, char *block, int *pos,
+                          long long *left);
+void pax_read_map(struct archive_in *in, long long stored,
+                  long long realsize, long long **mapp,
+                  long long *nregions, long long *datalen);
+#endif
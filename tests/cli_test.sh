@@ -0,0 +1,254 @@
+#!/bin/sh
+#
+# file: tests/cli_test.sh
+#
+# runs the mytar given as $1 on archives made in a fresh directory under
+# /tmp and checks what comes out. Prints each check that fails and exits
+# 1 if any did
+
+mytar=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+tmp=$(mktemp -d /tmp/mytar-cli.XXXXXX)
+failures=0
+trap 'rm -rf "$tmp"' EXIT
+
+check() {
+    if ! eval "$2"; then
+        echo "FAIL: $1"
+        failures=$((failures + 1))
+    fi
+}
+
+# $1 then nuls up to $2 bytes
+pad() {
+    printf '%s' "$1"
+    head -c $(($2 - ${#1})) /dev/zero
+}
+
+# a ustar member called $1 holding $2, of type $3 (default '0') linking
+# to $4, written by hand since mytar itself won't make names like these
+member() {
+    size=$(printf '%s' "$2" | wc -c)
+    {
+        pad "$1" 100
+        pad 0000644 8
+        pad 0000000 8
+        pad 0000000 8
+        pad "$(printf '%011o' "$size")" 12
+        pad 00000000000 12
+        printf '        '
+        printf '%s' "${3:-0}"
+        pad "$4" 100
+        printf 'ustar\000'
+        printf '00'
+        pad "" 247
+    } > "$tmp/header"
+    sum=$(od -An -tu1 -v "$tmp/header" | tr -s ' ' '\n' |
+          awk '{ s += $1 } END { print s }')
+    printf '%06o\000 ' "$sum" |
+        dd of="$tmp/header" bs=1 seek=148 conv=notrunc 2>/dev/null
+    cat "$tmp/header"
+    printf '%s' "$2"
+    head -c $(((512 - size % 512) % 512)) /dev/zero
+}
+
+# the two zero blocks that end an archive
+end() {
+    head -c 1024 /dev/zero
+}
+
+# nothing in an archive may be created outside the directory extract
+# runs in, whether its name is absolute or climbs out with ".."
+test_escapes() {
+    mkdir -p "$tmp/escape/ex" "$tmp/escape/target"
+    echo secret > "$tmp/escape/secret"
+    {
+        member "$tmp/escape/target/abs" "absolute"
+        member "../target/up" "climbed"
+        member "a/../../target/mid" "climbed"
+        member "../secret" "" 0
+        member "h" "" 1 "../secret"
+        member "./ok/file" "fine"
+        end
+    } > "$tmp/escape/escape.tar"
+    (cd "$tmp/escape/ex" && "$mytar" xf ../escape.tar 2>/dev/null)
+
+    check "absolute member written outside" \
+          "[ ! -e '$tmp/escape/target/abs' ]"
+    check "absolute member not extracted under ." \
+          "[ \"\$(cat '$tmp/escape/ex$tmp/escape/target/abs')\" = absolute ]"
+    check "'..' member written outside" "[ ! -e '$tmp/escape/target/up' ]"
+    check "'..' inside a member written outside" \
+          "[ ! -e '$tmp/escape/target/mid' ]"
+    check "'..' member replaced a file outside" \
+          "[ \"\$(cat '$tmp/escape/secret')\" = secret ]"
+    check "hard link to a file outside" "[ ! -e '$tmp/escape/ex/h' ]"
+    check "plain member next to bad ones" \
+          "[ \"\$(cat '$tmp/escape/ex/ok/file')\" = fine ]"
+}
+
+# a member of a type extract doesn't know ends it with a message
+test_bad_type() {
+    mkdir -p "$tmp/type"
+    { member "odd" "" Q; end; } > "$tmp/type/odd.tar"
+    (cd "$tmp/type" && "$mytar" xf odd.tar 2> err)
+    status=$?
+    check "unknown typeflag exits 1" "[ $status -eq 1 ]"
+    check "unknown typeflag message" \
+          "grep -q \"invalid typeflag - 'Q'\" '$tmp/type/err'"
+}
+
+# an incremental archive removes what was deleted since the last one
+# when extracted after it, and only a verbose listing shows the deletions
+test_incremental() {
+    mkdir -p "$tmp/inc/src/sub" "$tmp/inc/ex"
+    echo kept > "$tmp/inc/src/kept"
+    echo gone > "$tmp/inc/src/sub/gone"
+    (cd "$tmp/inc" && "$mytar" cf full.tar -g snap src &&
+        rm src/sub/gone && echo new > src/new &&
+        "$mytar" cf inc.tar -g snap src)
+    check "incremental create" "[ -f '$tmp/inc/inc.tar' ]"
+
+    check "plain listing leaves deletions out" \
+          "! (cd '$tmp/inc' && '$mytar' tf inc.tar) | grep -q gone"
+    check "verbose listing marks deletions" \
+          "(cd '$tmp/inc' && '$mytar' tvf inc.tar) |
+              grep -qx 'deleted: src/sub/gone'"
+    check "incremental leaves out what didn't change" \
+          "! (cd '$tmp/inc' && '$mytar' tf inc.tar) | grep -q kept"
+
+    (cd "$tmp/inc/ex" && "$mytar" xf ../full.tar && "$mytar" xf ../inc.tar)
+    check "deleted path removed" "[ ! -e '$tmp/inc/ex/src/sub/gone' ]"
+    check "new path added" "[ -f '$tmp/inc/ex/src/new' ]"
+    check "unchanged path kept" "[ -f '$tmp/inc/ex/src/kept' ]"
+}
+
+# a tree with a bit of everything create and extract handle: small and
+# big files, a sparse one, an empty directory and links
+make_tree() {
+    mkdir -p "$1/src/sub/deep" "$1/src/empty" "$1/build/tmp"
+    echo main > "$1/src/main.c"
+    echo util > "$1/src/sub/util.c"
+    echo obj > "$1/src/main.o"
+    echo note > "$1/src/sub/deep/notes.txt"
+    echo scratch > "$1/build/tmp/scratch"
+    head -c 3000000 /dev/urandom > "$1/src/big"
+    head -c 5000 /dev/urandom > "$1/src/sub/page"
+    dd if=/dev/urandom of="$1/src/sparse" bs=4096 count=1 seek=512 \
+       2>/dev/null
+    ln -s main.c "$1/src/link"
+    ln "$1/src/main.c" "$1/src/hard"
+}
+
+# -j only spreads the work over threads, the archive and the files it
+# extracts to are the same as with one
+test_threads() {
+    mkdir -p "$tmp/j/one" "$tmp/j/four"
+    make_tree "$tmp/j"
+    (cd "$tmp/j" && "$mytar" cf one.tar src && "$mytar" cf four.tar -j 4 src)
+    check "-j 4 create same as one thread" \
+          "cmp -s '$tmp/j/one.tar' '$tmp/j/four.tar'"
+
+    (cd "$tmp/j/one" && "$mytar" xf ../one.tar)
+    (cd "$tmp/j/four" && "$mytar" xf ../one.tar -j 4)
+    check "-j 4 extract same as one thread" \
+          "diff -r '$tmp/j/one/src' '$tmp/j/four/src' >/dev/null"
+    check "extract gives back the tree" \
+          "diff -r '$tmp/j/src' '$tmp/j/one/src' >/dev/null"
+    check "extract keeps symbolic links" \
+          "[ \"\$(readlink '$tmp/j/four/src/link')\" = main.c ]"
+    check "extract keeps hard links" \
+          "[ '$tmp/j/four/src/hard' -ef '$tmp/j/four/src/main.c' ]"
+}
+
+# --exclude leaves paths out of create, paths given to list and extract
+# pick out members and everything under them
+test_select() {
+    mkdir -p "$tmp/sel/ex"
+    make_tree "$tmp/sel"
+    printf '%s\n' 'notes.txt' 'build/tmp' > "$tmp/sel/excludes"
+    (cd "$tmp/sel" && "$mytar" cf ex.tar --exclude='*.o' \
+        --exclude-from=excludes src build)
+    (cd "$tmp/sel" && "$mytar" tf ex.tar) > "$tmp/sel/list"
+
+    check "--exclude glob on the last part" \
+          "! grep -q 'main\.o' '$tmp/sel/list'"
+    check "--exclude-from name" "! grep -q notes.txt '$tmp/sel/list'"
+    check "--exclude-from path with a slash" \
+          "! grep -q 'build/tmp' '$tmp/sel/list'"
+    check "--exclude keeps what doesn't match" \
+          "grep -qx 'src/sub/util.c' '$tmp/sel/list' &&
+              grep -qx 'build/' '$tmp/sel/list'"
+
+    check "list a wildcard" \
+          "[ \"\$(cd '$tmp/sel' && '$mytar' tf ex.tar 'src/*.c' |
+               sort | tr '\n' ' ')\" = 'src/main.c src/sub/util.c ' ]"
+    sub='src/sub/ src/sub/deep/ src/sub/page src/sub/util.c '
+    check "list a directory and what's under it" \
+          "[ \"\$(cd '$tmp/sel' && '$mytar' tf ex.tar src/sub | sort |
+               tr '\n' ' ')\" = '$sub' ]"
+
+    (cd "$tmp/sel/ex" && "$mytar" xf ../ex.tar src/sub 'src/m*')
+    check "extract picks out the paths given" \
+          "[ -f '$tmp/sel/ex/src/sub/util.c' ] &&
+              [ -f '$tmp/sel/ex/src/main.c' ]"
+    check "extract leaves out the rest" \
+          "[ ! -e '$tmp/sel/ex/src/big' ] && [ ! -e '$tmp/sel/ex/build' ]"
+}
+
+# list and extract with paths read only what the index points them to,
+# unless it no longer goes with the archive
+test_index() {
+    mkdir -p "$tmp/idx/ex"
+    make_tree "$tmp/idx"
+    (cd "$tmp/idx" && "$mytar" cf a.tar --index src)
+    check "--index writes ARCHIVE.idx" "[ -f '$tmp/idx/a.tar.idx' ]"
+
+    # spoil the first header without changing the size or mtime: only
+    # a read that goes by the index gets past it
+    touch -r "$tmp/idx/a.tar" "$tmp/idx/stamp"
+    printf 'X' | dd of="$tmp/idx/a.tar" bs=1 seek=148 conv=notrunc \
+        2>/dev/null
+    touch -r "$tmp/idx/stamp" "$tmp/idx/a.tar"
+    check "list goes by the index" \
+          "[ \"\$(cd '$tmp/idx' && '$mytar' tf a.tar src/sub/util.c \
+               2>/dev/null)\" = src/sub/util.c ]"
+    (cd "$tmp/idx/ex" && "$mytar" xf ../a.tar src/big 2>/dev/null)
+    check "extract goes by the index" \
+          "cmp -s '$tmp/idx/src/big' '$tmp/idx/ex/src/big'"
+
+    touch "$tmp/idx/a.tar"
+    (cd "$tmp/idx" && "$mytar" tf a.tar src/main.c >/dev/null 2> err)
+    check "out of date index is ignored with a warning" \
+          "grep -q 'a.tar.idx: out of date' '$tmp/idx/err'"
+}
+
+# --align starts the data of files of 4 KiB or more at a 4 KiB offset,
+# and the archive still extracts to the same files
+test_align() {
+    mkdir -p "$tmp/al/ex"
+    make_tree "$tmp/al"
+    printf 'MARKER' > "$tmp/al/src/marked"
+    head -c 8000 /dev/urandom >> "$tmp/al/src/marked"
+    (cd "$tmp/al" && "$mytar" cf a.tar --align src)
+    offset=$(grep -abo MARKER "$tmp/al/a.tar" | head -n 1 | cut -d: -f1)
+    check "--align puts data at a 4 KiB offset" \
+          "[ -n '$offset' ] && [ \$(($offset % 4096)) -eq 0 ]"
+
+    (cd "$tmp/al/ex" && "$mytar" xf ../a.tar)
+    check "aligned archive extracts the same" \
+          "diff -r '$tmp/al/src' '$tmp/al/ex/src' >/dev/null"
+}
+
+test_escapes
+test_bad_type
+test_incremental
+test_threads
+test_select
+test_index
+test_align
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "all command line tests passed"
@@ -0,0 +1,537 @@
+/*
+ * file: tests/libmytar_test.c
+ *
+ * round trips through the library's writer and reader (libmytar.h), and
+ * the ways each of them can fail
+ *
+ * everything happens in a fresh directory under /tmp. The only argument
+ * is the mytar binary, which makes the incremental archive the deleted
+ * entries are read from. Prints each check that fails and exits 1 if
+ * any did
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libmytar.h"
+
+/* bigger than a record, so it goes out in more than one */
+#define BIG_SIZE (300 * 1024)
+/* the sparse file, with data at the start, the middle and the end */
+#define SPARSE_SIZE (4 * 1024 * 1024)
+#define BLOCK 512
+/* writers running at once, and how many archives each writes */
+#define NTHREADS 4
+#define THREAD_ARCHIVES 50
+
+/* what a member read back should be */
+struct expect {
+    const char *path;
+    char type;
+    const char *linkpath;
+    const char *data;       /* NULL to skip comparing it */
+    size_t size;
+    int found;
+};
+
+static int failures = 0;
+static char big[BIG_SIZE];
+static char *sparse;
+static char longname[201];
+
+/* one thread's share of test_threads */
+struct thread_run {
+    pthread_t thread;
+    int n;
+    const char *uname, *gname; /* what every member should be owned by */
+    int bad;                /* archives that didn't come back right */
+};
+
+void check(int ok, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+void write_file(const char *path, const void *data, size_t len) {
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+            write(fd, data, len) != (ssize_t)len || close(fd) == -1) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/*
+ * the whole of a file in memory, its length in *len
+ */
+char *read_file(const char *path, size_t *len) {
+    struct stat st;
+    char *data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 ||
+            (data = malloc(st.st_size + 1)) == NULL ||
+            read(fd, data, st.st_size) != st.st_size) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    *len = st.st_size;
+    return data;
+}
+
+/*
+ * the files the writer tests archive, under dir/
+ */
+void make_tree(void) {
+    int fd, i;
+
+    for (i = 0; i < BIG_SIZE; i++) {
+        big[i] = "0123456789abcdef"[(i * 7 + i / 1000) % 16];
+    }
+    if ((sparse = calloc(1, SPARSE_SIZE)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(sparse, "start", 5);
+    memcpy(sparse + SPARSE_SIZE / 2, "middle", 6);
+    memcpy(sparse + SPARSE_SIZE - 3, "end", 3);
+
+    if (mkdir("dir", 0755) == -1 || symlink("hello.txt", "dir/link") == -1) {
+        perror("dir");
+        exit(1);
+    }
+    write_file("dir/hello.txt", "hello\n", 6);
+    write_file("dir/empty", "", 0);
+    write_file("dir/big", big, BIG_SIZE);
+
+    /* only the written parts take up space, if the filesystem can */
+    if ((fd = open("dir/sparse", O_WRONLY | O_CREAT, 0644)) == -1 ||
+            ftruncate(fd, SPARSE_SIZE) == -1 ||
+            pwrite(fd, "start", 5, 0) != 5 ||
+            pwrite(fd, "middle", 6, SPARSE_SIZE / 2) != 6 ||
+            pwrite(fd, "end", 3, SPARSE_SIZE - 3) != 3 || close(fd) == -1) {
+        perror("dir/sparse");
+        exit(1);
+    }
+
+    memset(longname, 'n', sizeof(longname) - 1);
+    memcpy(longname, "long/", 5);
+}
+
+/*
+ * read the archive at path and check it holds exactly what's in want
+ * (anything at all if want is NULL)
+ * returns the reader's last result: 0 at the end, -1 on an error
+ */
+int read_archive(const char *path, struct expect *want, int nwant,
+                 const char *what) {
+    struct mytar_reader *r;
+    struct mytar_entry e;
+    char msg[256], *data;
+    size_t cap = SPARSE_SIZE + 1, len;
+    ssize_t n;
+    int fd, ret, i;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || (data = malloc(cap)) == NULL ||
+            (r = mytar_reader_open(fd)) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < nwant; i++) {
+        want[i].found = 0;
+    }
+
+    while ((ret = mytar_next(r, &e)) == 1) {
+        for (len = 0; (n = mytar_read(r, data + len, cap - len)) > 0; ) {
+            len += n;
+        }
+        if (n == -1) {
+            ret = -1;
+            break;
+        }
+        if (want == NULL) {
+            continue;
+        }
+        for (i = 0; i < nwant && strcmp(want[i].path, e.path) != 0; i++)
+            ;
+        snprintf(msg, sizeof(msg), "%s: %.60s", what, e.path);
+        if (i == nwant) {
+            check(0, msg);
+            continue;
+        }
+        want[i].found = 1;
+        check(e.type == want[i].type, msg);
+        check(strcmp(e.linkpath, want[i].linkpath) == 0, msg);
+        if (want[i].data != NULL) {
+            check((size_t)e.size == want[i].size && len == want[i].size &&
+                  memcmp(data, want[i].data, len) == 0, msg);
+        }
+    }
+    if (ret == -1) {
+        snprintf(msg, sizeof(msg), "%s: %s", what, mytar_reader_error(r));
+    }
+    mytar_reader_close(r);
+    close(fd);
+    free(data);
+
+    if (ret == 0) {
+        for (i = 0; i < nwant; i++) {
+            snprintf(msg, sizeof(msg), "%s: %.60s missing", what,
+                     want[i].path);
+            check(want[i].found, msg);
+        }
+    } else if (want != NULL) {
+        check(0, msg);
+    }
+    return ret;
+}
+
+/*
+ * write dir/ and a few other members with the writer, then read them
+ * back and check everything came through
+ */
+void test_round_trip(int compress, const char *name) {
+    struct expect want[] = {
+        { "dir/", '5', "", NULL, 0, 0 },
+        { "dir/hello.txt", '0', "", "hello\n", 6, 0 },
+        { "dir/empty", '0', "", "", 0, 0 },
+        { "dir/link", '2', "hello.txt", NULL, 0, 0 },
+        { "dir/big", '0', "", big, BIG_SIZE, 0 },
+        { "dir/sparse", '0', "", NULL, SPARSE_SIZE, 0 },
+        { "from-fd", '0', "", "hello\n", 6, 0 },
+        { "mem/buffer", '0', "", "in memory", 9, 0 },
+        { longname, '0', "", "x", 1, 0 },
+    };
+    struct mytar_writer *w;
+    int fd, file;
+
+    want[5].data = sparse;
+    if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+            (file = open("dir/hello.txt", O_RDONLY)) == -1 ||
+            (w = mytar_writer_open(fd, compress)) == NULL) {
+        perror(name);
+        exit(1);
+    }
+    check(mytar_add_path(w, "dir") == 0, "add_path dir");
+    check(mytar_add_fd(w, "from-fd", file) == 0, "add_fd");
+    check(mytar_add_buffer(w, "mem/buffer", "in memory", 9, 0600,
+                           1700000000) == 0, "add_buffer");
+    check(mytar_add_buffer(w, longname, "x", 1, 0600, 1) == 0,
+          "add_buffer with a long name");
+    check(mytar_writer_finish(w) == 0, "writer_finish");
+    mytar_writer_close(w);
+    close(file);
+    close(fd);
+
+    check(read_archive(name, want, sizeof(want) / sizeof(want[0]), name)
+          == 0, name);
+}
+
+/*
+ * a path that isn't there or an fd that isn't a file is an error, but
+ * the archive can still be added to and finished
+ */
+void test_add_errors(void) {
+    struct expect want[] = {
+        { "after", '0', "", "still here", 10, 0 },
+    };
+    struct mytar_writer *w;
+    int fd, pipefd[2];
+
+    if ((fd = open("errors.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+            pipe(pipefd) == -1 || (w = mytar_writer_open(fd, 0)) == NULL) {
+        perror("errors.tar");
+        exit(1);
+    }
+    check(mytar_add_path(w, "not-there") == -1, "add_path of a missing path");
+    check(strstr(mytar_writer_error(w), strerror(ENOENT)) != NULL,
+          "add_path error message");
+    check(mytar_add_fd(w, "pipe", pipefd[0]) == -1, "add_fd of a pipe");
+    check(strstr(mytar_writer_error(w), "not a regular file") != NULL,
+          "add_fd error message");
+    check(mytar_add_buffer(w, "after", "still here", 10, 0644, 1) == 0,
+          "add_buffer after errors");
+    check(mytar_writer_finish(w) == 0, "writer_finish after errors");
+    check(mytar_writer_finish(w) == -1, "writer_finish twice");
+    mytar_writer_close(w);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+
+    check(read_archive("errors.tar", want, 1, "errors.tar") == 0,
+          "errors.tar");
+}
+
+/*
+ * a writer that can't write fails and stays failed, and closing it
+ * still lets go of everything
+ */
+void test_write_errors(void) {
+    struct mytar_writer *w;
+    int fd;
+
+    if ((fd = open("/dev/full", O_WRONLY)) == -1 ||
+            (w = mytar_writer_open(fd, 0)) == NULL) {
+        perror("/dev/full");
+        exit(1);
+    }
+    check(mytar_add_buffer(w, "big", big, BIG_SIZE, 0644, 1) == -1,
+          "add_buffer to a full disk");
+    check(strstr(mytar_writer_error(w), strerror(ENOSPC)) != NULL,
+          "full disk error message");
+    check(mytar_add_path(w, "dir") == -1, "add_path after an error");
+    check(mytar_writer_finish(w) == -1, "writer_finish after an error");
+    mytar_writer_close(w);
+
+    /* the same with the data still in the compressor when it fails */
+    if ((w = mytar_writer_open(fd, MYTAR_GZIP)) == NULL) {
+        perror("/dev/full");
+        exit(1);
+    }
+    mytar_add_path(w, "dir");
+    check(mytar_writer_finish(w) == -1, "gzip writer_finish to a full disk");
+    mytar_writer_close(w);
+    close(fd);
+
+#ifndef HAVE_ZSTD
+    if ((fd = open("zstd.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+            (w = mytar_writer_open(fd, MYTAR_ZSTD)) == NULL) {
+        perror("zstd.tar");
+        exit(1);
+    }
+    check(mytar_add_buffer(w, "a", "a", 1, 0644, 1) == -1,
+          "zstd writer without zstd");
+    mytar_writer_close(w);
+    close(fd);
+#endif
+}
+
+/*
+ * write len bytes of data to path, with the byte at where set to c
+ * (where -1 changes nothing)
+ */
+void write_damaged(const char *path, const char *data, size_t len,
+                   long where, const char *c) {
+    char *copy;
+
+    if ((copy = malloc(len)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(copy, data, len);
+    if (where >= 0) {
+        memcpy(copy + where, c, strlen(c));
+    }
+    write_file(path, copy, len);
+    free(copy);
+}
+
+/*
+ * damaged archives are errors from mytar_next or mytar_read, not crashes
+ * or archives that just end early
+ */
+void test_read_errors(void) {
+    char *data;
+    size_t len, i;
+
+    data = read_file("plain.tar", &len);
+
+    /* a header that doesn't match its checksum */
+    write_damaged("bad.tar", data, len, 0, "X");
+    check(read_archive("bad.tar", NULL, 0, "bad.tar") == -1,
+          "bad checksum");
+
+    /* cut off in the middle */
+    write_damaged("cut.tar", data, len / 2, -1, NULL);
+    check(read_archive("cut.tar", NULL, 0, "cut.tar") == -1,
+          "truncated archive");
+
+    /* a sparse map claiming more regions than it could hold, then one
+     * with a number too big for it */
+    for (i = 0; i + BLOCK < len; i += BLOCK) {
+        if (strstr(data + i, "GNUSparseFile.0") != NULL &&
+                    data[i + 156] == '0') {
+            break;
+        }
+    }
+    if (i + BLOCK < len) {
+        write_damaged("map.tar", data, len, i + BLOCK, "999999\n");
+        check(read_archive("map.tar", NULL, 0, "map.tar") == -1,
+              "sparse map with too many regions");
+        write_damaged("map.tar", data, len, i + BLOCK,
+                      "1\n99999999999999999999999\n");
+        check(read_archive("map.tar", NULL, 0, "map.tar") == -1,
+              "sparse map with an overflowing offset");
+    } else {
+        printf("skipped: this filesystem has no holes, no sparse member\n");
+    }
+
+    /* an extended header record longer than the header */
+    for (i = 0; i + BLOCK < len; i += BLOCK) {
+        if (strstr(data + i, "PaxHeaders") != NULL && data[i + 156] == 'x') {
+            break;
+        }
+    }
+    check(i + BLOCK < len, "plain.tar has an extended header");
+    if (i + BLOCK < len) {
+        write_damaged("pax.tar", data, len, i + BLOCK, "9999 ");
+        check(read_archive("pax.tar", NULL, 0, "pax.tar") == -1,
+              "extended header record past its end");
+    }
+    free(data);
+}
+
+/*
+ * paths an incremental archive records as deleted come out of the
+ * reader as DELFLAG ('R') entries
+ */
+void test_deleted(const char *mytar) {
+    struct expect want[] = {
+        { "inc/", '5', "", NULL, 0, 0 },
+        { "inc/gone", 'R', "", NULL, 0, 0 },
+        { "inc/gone2", 'R', "", NULL, 0, 0 },
+    };
+    char cmd[4096];
+
+    if (mkdir("inc", 0755) == -1) {
+        perror("inc");
+        exit(1);
+    }
+    write_file("inc/kept", "kept", 4);
+    write_file("inc/gone", "gone", 4);
+    write_file("inc/gone2", "gone", 4);
+    snprintf(cmd, sizeof(cmd), "%s cf inc1.tar -g snap inc && "
+             "rm inc/gone inc/gone2 && %s cf inc2.tar -g snap inc",
+             mytar, mytar);
+    if (system(cmd) != 0) {
+        check(0, "mytar incremental create");
+        return;
+    }
+    check(read_archive("inc2.tar", want, sizeof(want) / sizeof(want[0]),
+                       "inc2.tar") == 0, "inc2.tar");
+}
+
+/*
+ * write and read back THREAD_ARCHIVES archives of one member each
+ */
+void *run_thread(void *arg) {
+    struct thread_run *t = arg;
+    struct mytar_writer *w;
+    struct mytar_reader *r;
+    struct mytar_entry e;
+    char name[32];
+    int fd, i;
+
+    snprintf(name, sizeof(name), "thread%d.tar", t->n);
+    for (i = 0; i < THREAD_ARCHIVES; i++) {
+        if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ||
+                (w = mytar_writer_open(fd, 0)) == NULL) {
+            t->bad++;
+            return NULL;
+        }
+        if (mytar_add_buffer(w, "owned", "x", 1, 0644, 1) == -1 ||
+                mytar_writer_finish(w) == -1) {
+            t->bad++;
+        }
+        mytar_writer_close(w);
+
+        if (lseek(fd, 0, SEEK_SET) == -1 ||
+                (r = mytar_reader_open(fd)) == NULL) {
+            t->bad++;
+            close(fd);
+            return NULL;
+        }
+        if (mytar_next(r, &e) != 1 || strcmp(e.uname, t->uname) != 0 ||
+                strcmp(e.gname, t->gname) != 0) {
+            t->bad++;
+        }
+        mytar_reader_close(r);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * writers on different threads at once each get their members' owner
+ * names right, as libmytar.h promises
+ */
+void test_threads(void) {
+    struct thread_run runs[NTHREADS];
+    struct passwd *pw;
+    struct group *gr;
+    char uname[64] = "", gname[64] = "";
+    int i;
+
+    /* names are cut to fit the header, like create does */
+    if ((pw = getpwuid(getuid())) != NULL) {
+        snprintf(uname, sizeof(uname), "%.31s", pw->pw_name);
+    }
+    if ((gr = getgrgid(getgid())) != NULL) {
+        snprintf(gname, sizeof(gname), "%.31s", gr->gr_name);
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        runs[i].n = i;
+        runs[i].uname = uname;
+        runs[i].gname = gname;
+        runs[i].bad = 0;
+        if (pthread_create(&runs[i].thread, NULL, run_thread, &runs[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_join(runs[i].thread, NULL);
+        check(runs[i].bad == 0, "writers on several threads");
+    }
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/mytar-test.XXXXXX", mytar[4096], cmd[4096];
+
+    if (argc != 2 || realpath(argv[1], mytar) == NULL) {
+        fprintf(stderr, "usage: libmytar_test path/to/mytar\n");
+        return 1;
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+        perror(dir);
+        return 1;
+    }
+    make_tree();
+
+    test_round_trip(0, "plain.tar");
+    test_round_trip(MYTAR_GZIP, "gzip.tar.gz");
+#ifdef HAVE_ZSTD
+    test_round_trip(MYTAR_ZSTD, "zstd.tar.zst");
+#endif
+    test_add_errors();
+    test_write_errors();
+    test_read_errors();
+    test_deleted(mytar);
+    test_threads();
+
+    if (chdir("/") == 0) {
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        if (system(cmd) != 0) {
+            fprintf(stderr, "couldn't remove %s\n", dir);
+        }
+    }
+    free(sparse);
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all library tests passed\n");
+    return 0;
+}
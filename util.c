@@ -4,7 +4,8 @@
  * helper functions used by all of the modes
  */
 
-#include <arpa/inet.h> 
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -12,24 +13,89 @@
 #include <stdlib.h>
 
 #include "util.h"
+#include "archive.h"
+#include "codec.h"
+
+__thread struct error_trap *error_trap = NULL;
 
 /*
- * calculate the chksum field for the header
+ * perror(what) and exit, or jump back to the library call running
  */
-int calculate_checksum(unsigned char *head) {
-    int i, sum = 0;
+void fail(const char *what) {
+    if (error_trap != NULL) {
+        snprintf(error_trap->msg, sizeof(error_trap->msg), "%s: %s",
+                        what, strerror(errno));
+        longjmp(error_trap->env, 1);
+    }
+    perror(what);
+    exit(EXIT_FAILURE);
+}
 
-    for (i = 0; i < sizeof(struct tarheader); i++) {
-        /* not in the chksum field? add each byte to the sum */
-        if (i < CHKSUM_BEGIN || i > CHKSUM_END) {
-            sum += *(head+i);
-        } else {
-            /* skip the chksum field and just put in spaces*/
-            sum += ' ';
-        }
+/*
+ * print the message and exit, or jump back to the library call running
+ */
+void fail_msg(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (error_trap != NULL) {
+        vsnprintf(error_trap->msg, sizeof(error_trap->msg), fmt, ap);
+        va_end(ap);
+        longjmp(error_trap->env, 1);
     }
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(EXIT_FAILURE);
+}
 
-    return sum;
+/*
+ * perror(what) for a member that is left out, the rest carries on
+ * a library call keeps the message for its caller instead
+ */
+void report(const char *what) {
+    if (error_trap != NULL) {
+        snprintf(error_trap->msg, sizeof(error_trap->msg), "%s: %s",
+                        what, strerror(errno));
+        error_trap->warnings++;
+        return;
+    }
+    perror(what);
+}
+
+/*
+ * report for a member left out with a message of its own, not errno's
+ */
+void report_msg(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (error_trap != NULL) {
+        vsnprintf(error_trap->msg, sizeof(error_trap->msg), fmt, ap);
+        error_trap->warnings++;
+    } else {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+    va_end(ap);
+}
+
+/*
+ * write all n bytes of buf to fd, picking up after short writes
+ */
+void write_all(int fd, const char *buf, size_t n) {
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(fd, buf, n)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("mytar");
+        }
+        buf += w;
+        n -= w;
+    }
 }
 
 /*
@@ -38,21 +104,21 @@ int calculate_checksum(unsigned char *head) {
  * then, check if the chksum in the header is equal to what we expect
  * then, checks if the magic and version are correct
  */
-int check_currupt_archive(int tarfile, struct tarheader *head, int strict) {
+int check_currupt_archive(struct archive_in *in, struct tarheader *head,
+                                int strict) {
     int chksum, expected_chksum;
     int next_chksum, next_expected_chksum;
     
-    chksum = strtol(head->chksum, NULL, OCTAL);
+    chksum = get_number(head->chksum, sizeof(head->chksum));
     expected_chksum = calculate_checksum((unsigned char *)head);
     
     /* if the block is all zeros (stop block?) */
     if (chksum == 0 && expected_chksum == EMPTY_CHKSUM) {
         /* read in the next block to check the second stop block */ 
-        if (read(tarfile, head, BLOCK) == -1) {
-            perror("mytar");
-            exit(1);
+        if (in_read(in, head, BLOCK) != BLOCK) {
+            fail_msg("error: currupted archive");
         }
-        next_chksum = strtol(head->chksum, NULL, OCTAL);
+        next_chksum = get_number(head->chksum, sizeof(head->chksum));
         next_expected_chksum = calculate_checksum((unsigned char *)head);
         
         /* if the second stop block checks out, finish successfully */
@@ -60,76 +126,30 @@ int check_currupt_archive(int tarfile, struct tarheader *head, int strict) {
             return 0;
         /* else, the file must be currupt */
         } else {
-            fprintf(stderr, "error: currupted archive\n");
-            exit(1);
+            fail_msg("error: currupted archive");
         }
     }
     
     /* if the chksums don't match, archive must be currupt */
     if (chksum != expected_chksum) {
-        fprintf(stderr, "error: currupted archive\n");
-        exit(1);
+        fail_msg("error: currupted archive");
     }
     
     /* strict mode checks ustar/0 and 00 */
     if (strict) {
         if (strcmp("ustar", head->magic) != 0) {
-            fprintf(stderr, "error: header magic is not correct\n");
-            exit(1);
+            fail_msg("error: header magic is not correct");
         }
         if (strncmp("00", head->version, VERSION_SIZE) != 0) {
-            fprintf(stderr, "error: header version is not correct\n");
-            exit(1);
+            fail_msg("error: header version is not correct");
         }
     /* non-strict just checks the first 5 chars of magic */
     } else {
         if (strncmp("ustar", head->magic, MAGIC_SIZE) != 0) {
-            fprintf(stderr, "error: header magic is not correct\n");
-            exit(EXIT_FAILURE);
+            fail_msg("error: header magic is not correct");
         }
     }
     
     /* lets the caller know we have not hit the end of the archive */
     return 1;
 }
-
-uint32_t extract_special_int(char *where, int len) {
-    /* For interoperability with GNU tar. GNU seems to
-    * set the high–order bit of the first byte, then
-    * treat the rest of the field as a binary integer
-    * in network byte order.
-    * I don’t know for sure if it’s a 32 or 64–bit int, 
-    * but for * this version, we’ll only support 32. (well, 31)
-    * returns the integer on success, –1 on failure.
-    * In spite of the name of htonl(), it converts int32 t */
-    int32_t val = -1;
-    if ( (len >= sizeof(val)) && (where[0] & 0x80)) {
-        /* the top bit is set and we have space * extract the last four bytes */
-        val = *(int32_t *)(where+len-sizeof(val));
-        val = ntohl(val); /* convert to host byte order */
-    }
-    return val;
-}
-
-int insert_special_int(char *where, size_t size, int32_t val) { 
-    /* For interoperability with GNU tar. GNU seems to
-    * set the high–order bit of the first byte, then
-    * treat the rest of the field as a binary integer
-    * in network byte order.
-    * Insert the given integer into the given field
-    * using this technique. Returns 0 on success, nonzero * otherwise
-    */
-    int err=0;
-    if (val<0||(size<sizeof(val))){
-        /* if it’s negative, bit 31 is set and we can’t use the flag
-        * if len is too small, we can’t write it. * done.
-        */
-        err++;
-    } else {
-        /* game on....*/
-        memset(where, 0, size);
-        *(int32_t *)(where+size-sizeof(val)) = htonl(val); /* place the int */
-        *where |= 0x80; /* set that high–order bit */
-    }
-    return err; 
-}
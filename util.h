@@ -1,11 +1,19 @@
 #ifndef _UTIL_H
 #define _UTIL_H
+#include <setjmp.h>
 #include <stdint.h>
 
 #define RFLAG '0'
 #define RFLAG_ALT '\0'
+#define HFLAG '1'
 #define LFLAG '2'
 #define DFLAG '5'
+/*
+ * the type the index and the library give a path deleted since the last
+ * incremental; it is never a member's typeflag, the archive only has it
+ * as a MYTAR.deleted record in a global header (see write_deleted)
+ */
+#define DELFLAG 'R'
 
 #define PATH_MAX_ 256
 #define NAME_MAX_ 100
@@ -17,6 +25,10 @@
 #define LINK_MAX 100
 
 #define BLOCK 512
+/* n rounded up to a whole number of blocks */
+#define BLOCK_ROUND(n) (((n) + BLOCK - 1) / BLOCK * BLOCK)
+/* what --align lines file data up to, a filesystem block */
+#define ALIGN_SIZE 4096
 #define MTIME_SIZE 12
 #define SIZE_SIZE 12
 #define ID_SIZE 8
@@ -33,7 +45,30 @@
 
 #define MODE_MASK 07777
 #define PERM_MASK 256
-#define SPECIAL_INT_MASK 0x800000
+
+/* orders create can read the entries of a directory in */
+#define SORT_NONE 0
+#define SORT_INODE 1
+#define SORT_DISK 2
+
+struct matcher;
+
+/* everything given on the command line besides the mode and the paths */
+struct options {
+    int verbose;    /* v: list files as they are processed */
+    int strict;     /* S: strict interpretation of the ustar standard */
+    int jobs;       /* -j N: threads used by create, 0 if not given */
+    int blocking;   /* -b N: blocks per record written, 0 if not given */
+    int numeric_owner; /* --numeric-owner: no user/group names in headers */
+    char *snapshot; /* -g FILE: snapshot for incremental create */
+    int posix;      /* --posix: extended header with the exact mtime on all */
+    int sort;       /* --sort: SORT_NONE, SORT_INODE or SORT_DISK */
+    int compress;   /* z/Z: COMP_GZIP or COMP_ZSTD for create */
+    struct matcher *exclude; /* --exclude: paths create leaves out */
+    int align;      /* --align: file data at ALIGN_SIZE offsets (create) */
+    int occurrence; /* --occurrence: stop once the paths given are found */
+    int index;      /* --index: write ARCHIVE.idx with the archive (create) */
+};
 
 /* all fields are made chars so we dont get warnings when using
  * functions like sprintf which expect a char
@@ -58,9 +93,27 @@ struct __attribute__ ((__packed__)) tarheader {
     char pad[12]; /* make the struct perfectly 512 bytes */
 };
 
-int calculate_checksum(unsigned char *head);
-int check_currupt_archive(int tarfile, struct tarheader *head, int strict);
-int insert_special_int(char *where, size_t size, int32_t val);
-uint32_t extract_special_int(char *where, int len);
+struct archive_in;
+
+/*
+ * while a library call (libmytar.c) is running, errors that would end
+ * mytar jump back to it instead, with what would have been printed
+ */
+struct error_trap {
+    jmp_buf env;
+    char msg[256];
+    int warnings;   /* members left out, the last one's reason is in msg */
+};
+
+extern __thread struct error_trap *error_trap;
+
+void fail(const char *what) __attribute__((noreturn));
+void fail_msg(const char *fmt, ...)
+        __attribute__((noreturn, format(printf, 1, 2)));
+void report(const char *what);
+void report_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void write_all(int fd, const char *buf, size_t n);
+int check_currupt_archive(struct archive_in *in, struct tarheader *head,
+                                int strict);
 
 #endif